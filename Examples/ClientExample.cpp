@@ -20,9 +20,16 @@ int main(int argc, char* argv[])
       printf("%s slider value: %f\n", Kontroller::getName(slider), value);
    });
 
-   while (!client.getState().stop)
+   uint64_t version = client.getStateVersion();
+   bool stop = client.getState().stop;
+   while (!stop)
    {
-      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      // Sleeps until something changes, rather than repeatedly polling
+      if (std::optional<Kontroller::StateChange> change = client.waitForChange(version, std::chrono::seconds(1)))
+      {
+         version = change->version;
+         stop = change->state.stop;
+      }
    }
 
    return 0;
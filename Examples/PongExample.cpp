@@ -208,13 +208,20 @@ namespace
          Kontroller::LED::Group8Record, Kontroller::LED::Group8Mute, Kontroller::LED::Group8Solo,
       } };
 
+      uint32_t ledMask = 0;
       for (size_t x = 0; x < pixels.size(); ++x)
       {
          for (size_t y = 0; y < pixels[x].size(); ++y)
          {
-            device.setLEDOn(kLEDs[x][y], pixels[x][y]);
+            if (pixels[x][y])
+            {
+               ledMask |= Kontroller::getLEDMask(kLEDs[x][y]);
+            }
          }
       }
+
+      // Only sends the LEDs that changed since the last frame
+      device.setLEDs(ledMask);
    }
 }
 
@@ -1,23 +1,69 @@
 #pragma once
 
+#include "Kontroller/Event.h"
+#include "Kontroller/Notification.h"
 #include "Kontroller/Packet.h"
 #include "Kontroller/State.h"
+#include "Kontroller/Subscription.h"
+
+#include <readerwriterqueue.h>
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <string>
 #include <thread>
 
 namespace Kontroller
 {
+   class Notifier;
+   class StateLock;
+
    class Client
    {
    public:
+      struct Settings
+      {
+         // Either a host name / address (to connect over TCP), or "unix:/path/to/socket" (or just "unix:" for the default path) to connect to a server on the same machine
+         std::string endpoint = "127.0.0.1";
+
+         int timeoutMilliseconds = 100;
+         int retryMilliseconds = 1000;
+
+         // Controls to receive events for, the server doesn't send anything else (and the state of other controls isn't kept up to date)
+         Subscription subscription;
+
+         // Maximum number of updates per second to receive (0 for no limit), the server collects changes in between and sends them together
+         // Button events are always delivered, but only the latest value of each dial / slider is sent in each update
+         int maxUpdateRate = 0;
+
+         // Number of events to buffer for pollEvents() (0 to disable the queue), the queue is allocated up front and never grows
+         std::size_t eventQueueCapacity = 0;
+
+         bool printErrorMessages = false;
+
+         Settings() {} // Needed due to an issue in clang (Default member initializer needed within definition of enclosing class outside of member functions)
+      };
+
+      explicit Client(const Settings& clientSettings);
       Client(const char* endpoint = "127.0.0.1", int timeoutMilliseconds = 100, int retryMilliseconds = 1000, bool printErrorMessages = false);
       ~Client();
 
-      State getState() const;
+      // Never blocks (or waits on the thread that updates the state), so it is safe to call from real-time threads
+      // Optionally returns the version of the state that was read (see getStateVersion())
+      State getState(uint64_t* version = nullptr) const;
+
+      // Increases whenever the state changes, so that callers can cheaply skip work when nothing has changed
+      uint64_t getStateVersion() const;
+
+      // Blocks until the state is newer than the given version (e.g. from getStateVersion() or a previous change), or the timeout expires (returning nullopt)
+      std::optional<StateChange> waitForChange(uint64_t lastVersion, std::chrono::milliseconds timeout) const;
 
       bool isConnected() const
       {
@@ -37,16 +83,94 @@ namespace Kontroller
       void setSliderCallback(SliderCallback callback);
       void clearSliderCallback();
 
+      // Called for every event (in addition to the callbacks above), along with its sequence number and the time the server read it from the device (when the server provides them)
+      using EventCallback = std::function<void(const Event&)>;
+
+      void setEventCallback(EventCallback callback);
+      void clearEventCallback();
+
+      // Copies up to maxEvents of the oldest queued events into the given array (in the order they arrived), returning how many were copied
+      // Only available if the event queue is enabled, and must only be called from one thread at a time (which never blocks the thread that queues the events)
+      std::size_t pollEvents(Event* events, std::size_t maxEvents);
+
+      // Number of events that didn't fit in the event queue (because it wasn't polled often enough) and were lost
+      uint64_t getNumDroppedEvents() const
+      {
+         return numDroppedEvents.load();
+      }
+
+      // Becomes readable (or signaled, on Windows) when there are new events or state, for waiting on in an external event loop (e.g. with epoll)
+      // Stays that way until clearNotification() is called, which should be done before reading the state / polling events (so that nothing is missed)
+      NotificationHandle getNotificationHandle() const;
+      void clearNotification();
+
+      // How the client caught up with the server after connecting, reconnecting or changing its subscription
+      enum class SyncType
+      {
+         // The current value of every subscribed control was delivered through the callbacks
+         Snapshot,
+
+         // The client picked up where it left off before reconnecting, and only the events it missed are delivered (after the sync callback)
+         Delta
+      };
+
+      // Not called when connected to a server that only speaks version 1 of the protocol
+      using SyncCallback = std::function<void(SyncType)>;
+
+      void setSyncCallback(SyncCallback callback);
+      void clearSyncCallback();
+
+      // Changes which controls to receive (takes effect within timeoutMilliseconds), the current values of the subscribed controls are delivered again through the callbacks
+      void setSubscription(const Subscription& newSubscription);
+      Subscription getSubscription() const;
+
    private:
-      void run(const char* endpoint);
-      void updateState(const EventPacket& packet);
+      // What was agreed with the server for the current connection (only used by the client's thread)
+      struct Session
+      {
+         uint8_t protocolVersion = 0;
+
+         // Zero if the server doesn't send heartbeats
+         int heartbeatMilliseconds = 0;
+         int idleTimeoutMilliseconds = 0;
+
+         // Controls covered by the last State / PartialState frame (or by the hello, when resuming)
+         uint64_t subscription = Subscription::kAllControls;
+      };
+
+      // Last point in the server's event stream that the client was fully up to date with, kept across connections (only used by the client's thread)
+      struct ResumePoint
+      {
+         bool valid = false;
+         uint64_t epoch = 0;
+         uint64_t sequence = 0;
+         uint64_t subscription = 0;
+      };
+
+      void run(const std::string& endpoint);
+      std::size_t processData(const uint8_t* data, std::size_t size, Session& session);
+      void updateState(const EventPacket& packet, uint64_t sequence = 0, std::chrono::steady_clock::time_point timestamp = {});
+      void notifySync(SyncType type);
 
       const int timeoutMS = 100;
       const int retryMS = 1000;
       const bool printErrors = false;
+      const int maxUpdateRate = 0;
+
+      Subscription subscription;
+      mutable std::mutex subscriptionMutex;
+      std::atomic_bool subscriptionChanged = { false };
+
+      ResumePoint resumePoint;
+
+      // Only written by the client's thread
+      std::unique_ptr<StateLock> stateLock;
+
+      // Filled by the client's thread, drained by pollEvents() (null if disabled)
+      std::unique_ptr<moodycamel::ReaderWriterQueue<Event>> eventQueue;
+      std::atomic<uint64_t> numDroppedEvents = { 0 };
 
-      State state;
-      mutable std::mutex stateMutex;
+      std::unique_ptr<Notifier> notifier;
 
       std::thread thread;
       std::condition_variable cv;
@@ -58,5 +182,7 @@ namespace Kontroller
       ButtonCallback buttonCallback;
       DialCallback dialCallback;
       SliderCallback sliderCallback;
+      EventCallback eventCallback;
+      SyncCallback syncCallback;
    };
 }
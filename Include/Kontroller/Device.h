@@ -1,22 +1,31 @@
 #pragma once
 
+#include "Kontroller/Event.h"
+#include "Kontroller/Notification.h"
 #include "Kontroller/State.h"
 
 #include <readerwriterqueue.h>
 
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
 #include <cstdint>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <thread>
 
 namespace Kontroller
 {
+   class Notifier;
+   class StateLock;
+
    class Device
    {
    public:
-      Device();
+      // Events are also buffered for pollEvents() if given a queue capacity, the queue is allocated up front and never grows
+      explicit Device(std::size_t eventQueueCapacity = 0);
       ~Device();
 
       bool isConnected() const
@@ -24,12 +33,25 @@ namespace Kontroller
          return communicatorConnected.load();
       }
 
-      State getState() const;
+      // Never blocks (or waits on the thread that updates the state), so it is safe to call from real-time threads
+      // Optionally returns the version of the state that was read (see getStateVersion())
+      State getState(uint64_t* version = nullptr) const;
+
+      // Increases whenever the state changes, so that callers can cheaply skip work when nothing has changed
+      uint64_t getStateVersion() const;
+
+      // Blocks until the state is newer than the given version (e.g. from getStateVersion() or a previous change), or the timeout expires (returning nullopt)
+      std::optional<StateChange> waitForChange(uint64_t lastVersion, std::chrono::milliseconds timeout) const;
+
       void setState(const State& newState);
 
       void enableLEDControl(bool enable);
       void setLEDOn(LED led, bool on);
 
+      // Sets every LED at once, one bit per LED (see getLEDMask())
+      // Only the LEDs that differ from what the device is already showing are sent, all in a single message, so it is cheap to call every frame
+      void setLEDs(uint32_t ledMask);
+
       using ButtonCallback = std::function<void(Button, bool)>;
       using DialCallback = std::function<void(Dial, float)>;
       using SliderCallback = std::function<void(Slider, float)>;
@@ -43,6 +65,27 @@ namespace Kontroller
       void setSliderCallback(SliderCallback callback);
       void clearSliderCallback();
 
+      // Called for every event (in addition to the callbacks above), along with its sequence number and timestamp
+      using EventCallback = std::function<void(const Event&)>;
+
+      void setEventCallback(EventCallback callback);
+      void clearEventCallback();
+
+      // Copies up to maxEvents of the oldest queued events into the given array (in the order they arrived), returning how many were copied
+      // Only available if the event queue is enabled, and must only be called from one thread at a time (which never blocks the thread that queues the events)
+      std::size_t pollEvents(Event* events, std::size_t maxEvents);
+
+      // Number of events that didn't fit in the event queue (because it wasn't polled often enough) and were lost
+      uint64_t getNumDroppedEvents() const
+      {
+         return numDroppedEvents.load();
+      }
+
+      // Becomes readable (or signaled, on Windows) when there are new events or state, for waiting on in an external event loop (e.g. with epoll)
+      // Stays that way until clearNotification() is called, which should be done before reading the state / polling events (so that nothing is missed)
+      NotificationHandle getNotificationHandle() const;
+      void clearNotification();
+
       class Communicator;
 
    private:
@@ -50,6 +93,9 @@ namespace Kontroller
       {
          uint8_t id = 0;
          uint8_t value = 0;
+
+         uint64_t sequence = 0;
+         std::chrono::steady_clock::time_point timestamp;
       };
 
       struct MidiCommand
@@ -57,23 +103,36 @@ namespace Kontroller
          enum class Type : uint8_t
          {
             Control,
-            LED
+            LED,
+            LEDs
          };
 
          Type type = Type::Control;
          Kontroller::LED led = Kontroller::LED::None;
          bool value = false;
+         uint32_t ledMask = 0;
       };
 
-      void queueMessage(uint8_t id, uint8_t value);
+      void receiveMessage(uint8_t id, uint8_t value, std::chrono::steady_clock::time_point timestamp);
 
+      void wakeThread();
       void threadRun();
       void processMessage(MidiMessage message);
 
       static const char* const kDeviceName;
 
-      State state;
-      mutable std::mutex stateMutex;
+      // Writers (the device's thread and setState()) take the write mutex, readers never do
+      std::unique_ptr<StateLock> stateLock;
+      std::mutex stateWriteMutex;
+
+      // Filled by the device's thread, drained by pollEvents() (null if disabled)
+      std::unique_ptr<moodycamel::ReaderWriterQueue<Event>> eventQueue;
+      std::atomic<uint64_t> numDroppedEvents = { 0 };
+
+      std::unique_ptr<Notifier> notifier;
+
+      // Wakes the device's thread when it waits for input along with everything else (see Communicator::kReadsOnDeviceThread), otherwise the condition variable is used
+      std::unique_ptr<Notifier> wakeNotifier;
 
       std::thread thread;
       std::condition_variable cv;
@@ -83,6 +142,9 @@ namespace Kontroller
 
       std::atomic_bool communicatorConnected = { false };
 
+      // Only used by the thread that receives data from the device
+      uint64_t nextMessageSequence = 1;
+
       moodycamel::ReaderWriterQueue<MidiMessage> messageQueue;
       moodycamel::ReaderWriterQueue<MidiCommand> commandQueue;
 
@@ -90,5 +152,6 @@ namespace Kontroller
       ButtonCallback buttonCallback;
       DialCallback dialCallback;
       SliderCallback sliderCallback;
+      EventCallback eventCallback;
    };
 }
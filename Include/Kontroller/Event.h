@@ -0,0 +1,32 @@
+#pragma once
+
+#include "Kontroller/State.h"
+
+#include <chrono>
+#include <cstdint>
+
+namespace Kontroller
+{
+   // A single change to a control, along with where it sits in the stream of events and when it was read from the device
+   struct Event
+   {
+      // Exactly one of these is set
+      Button button = Button::None;
+      Dial dial = Dial::None;
+      Slider slider = Slider::None;
+
+      // Buttons only
+      bool pressed = false;
+
+      // Dials and sliders only
+      float value = 0.0f;
+
+      // Increases by one with every event, so gaps mean that events were lost (or conflated / dropped by a server whose client fell behind)
+      // Zero for events that don't come from the device directly (e.g. the state sent by a server when a client connects, or events from a server that doesn't send sequence numbers)
+      uint64_t sequence = 0;
+
+      // When the device's data was read (or received by the kernel, on Linux with KONTROLLER_MIDI_TIMESTAMPS), on the steady clock of the machine that the device is attached to (so only comparable to clock readings from that machine)
+      // Default constructed when unknown
+      std::chrono::steady_clock::time_point timestamp;
+   };
+}
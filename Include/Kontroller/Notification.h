@@ -0,0 +1,14 @@
+#pragma once
+
+namespace Kontroller
+{
+   // Something that an external event loop can wait on (see Client::getNotificationHandle() and Device::getNotificationHandle())
+   // A file descriptor that becomes readable (an eventfd on Linux, the read end of a pipe on other platforms), or an event object that becomes signaled on Windows
+#if defined(_WIN32)
+   using NotificationHandle = void*;
+   const NotificationHandle kInvalidNotificationHandle = nullptr;
+#else
+   using NotificationHandle = int;
+   const NotificationHandle kInvalidNotificationHandle = -1;
+#endif
+}
@@ -6,6 +6,9 @@ namespace Kontroller
 {
    const char* const kPort = "40807";
 
+   // Default path of the server's unix domain socket (clients connect to it with an endpoint of "unix:" or "unix:/some/other/path")
+   const char* const kUnixSocketPath = "/tmp/kontroller.sock";
+
    struct EventPacket
    {
       enum Type : uint16_t
@@ -1,33 +1,86 @@
 #pragma once
 
+#include "Kontroller/Packet.h"
 #include "Kontroller/State.h"
 
-#include <readerwriterqueue.h>
-
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <cstddef>
 #include <cstdint>
-#include <cstdlib>
 #include <filesystem>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <string>
 #include <thread>
 #include <vector>
 
 namespace Kontroller
 {
    class Device;
+   class SharedMemory;
+   struct SharedEventBlock;
+   struct SharedStateBlock;
+
+   template<std::size_t Capacity>
+   class EventRing;
 
    class Server
    {
    public:
+      // What to do with a client that falls further behind than the limits in Settings allow
+      enum class BackpressurePolicy
+      {
+         // Skip the oldest events that haven't been sent to the client yet
+         DropOldest,
+
+         // Only keep the latest value of each dial / slider (button presses are still delivered in order)
+         Conflate,
+
+         // Close the connection (the client receives the current state when it reconnects)
+         Disconnect
+      };
+
       struct Settings
       {
          int timeoutMilliseconds = 100;
          int retryMilliseconds = 1000;
 
+         // Number of threads used to service client connections (each multiplexes many connections)
+         int numIOThreads = 1;
+
+         // Events that arrive within this long of the previous send are batched into a single write (an isolated event is always sent immediately)
+         int coalesceMilliseconds = 2;
+
+         // How long to wait for a newly connected client to say which version of the protocol it speaks before assuming version 1 (which never says anything)
+         int helloTimeoutMilliseconds = 50;
+
+         // Clients that support heartbeats are sent one whenever nothing else has been sent for this long, and are disconnected when nothing has been received from them for the idle timeout (they do the same to the server)
+         // Other TCP clients get the idle timeout as a target for TCP keepalive instead, which only detects a peer that is gone while the connection is quiet (and may take a few seconds, since keepalive works in whole seconds)
+         // Set either to 0 to disable heartbeats
+         int heartbeatMilliseconds = 100;
+         int idleTimeoutMilliseconds = 500;
+
+         // Limits on how far a client may fall behind: events it hasn't been sent yet, and encoded data held for it while its socket is full
+         std::size_t maxClientBacklogEvents = 1024;
+         std::size_t maxClientBacklogBytes = 64 * 1024;
+         BackpressurePolicy backpressurePolicy = BackpressurePolicy::Conflate;
+
+         // Reconnecting clients that missed at most this many events are only sent those events instead of the full state (limited by how far back the server's event history goes)
+         std::size_t maxResumeEvents = 1024;
+
+         // Clients on the same machine can connect through a unix domain socket at this path (not supported on Windows), set to nullopt to disable
+         std::optional<std::filesystem::path> unixSocketPath = std::filesystem::path(kUnixSocketPath);
+
+         // Name of a shared memory block to publish the state into, for SharedStateReader (e.g. kSharedStateName)
+         std::optional<std::string> sharedStateName;
+
+         // Name of a shared memory block to publish every event into, for SharedEventReader (e.g. kSharedEventsName)
+         std::optional<std::string> sharedEventsName;
+
          bool serializeStateToFile = true;
          std::optional<std::filesystem::path> filePathOverride;
 
@@ -46,6 +99,25 @@ namespace Kontroller
          return listening.load();
       }
 
+      // Backpressure counters for every client address that has connected since the server started
+      struct ClientStats
+      {
+         std::string address;
+         std::size_t numConnections = 0;
+
+         uint64_t droppedEvents = 0;
+         uint64_t conflatedEvents = 0;
+         uint64_t resyncs = 0;
+         uint64_t disconnects = 0;
+         uint64_t idleTimeouts = 0;
+         uint64_t resumes = 0;
+
+         // Hellos that arrived after the connection had already been treated as version 1 (see helloTimeoutMilliseconds)
+         uint64_t lateHellos = 0;
+      };
+
+      std::vector<ClientStats> getClientStats() const;
+
       struct ButtonEvent
       {
          Button button = Button::None;
@@ -65,54 +137,39 @@ namespace Kontroller
       };
 
    private:
-      struct ThreadData
+      struct Connection;
+      struct Reactor;
+
+      struct ClientCounters
       {
-         uint64_t encodedSocket = 0;
-         std::atomic_bool complete = { false };
-
-         std::thread thread;
-         std::condition_variable cv;
-         std::mutex eventMutex;
-         std::atomic_bool eventPending = { false };
-
-         moodycamel::ReaderWriterQueue<ButtonEvent> buttonQueue;
-         moodycamel::ReaderWriterQueue<DialEvent> dialQueue;
-         moodycamel::ReaderWriterQueue<SliderEvent> sliderQueue;
-
-         static inline void* operator new(std::size_t size)
-         {
-#if defined(_MSC_VER)
-            return _aligned_malloc(size, MOODYCAMEL_CACHE_LINE_SIZE);
-#elif defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
-            void* result = nullptr;
-            posix_memalign(&result, MOODYCAMEL_CACHE_LINE_SIZE, size);
-            return result;
-#else
-            return std::aligned_alloc(MOODYCAMEL_CACHE_LINE_SIZE, size);
-#endif
-         }
-
-         static inline void operator delete(void* ptr)
-         {
-#if defined(_MSC_VER)
-            _aligned_free(ptr);
-#else
-            free(ptr);
-#endif
-         }
+         std::atomic<std::size_t> numConnections = { 0 };
+
+         std::atomic<uint64_t> droppedEvents = { 0 };
+         std::atomic<uint64_t> conflatedEvents = { 0 };
+         std::atomic<uint64_t> resyncs = { 0 };
+         std::atomic<uint64_t> disconnects = { 0 };
+         std::atomic<uint64_t> idleTimeouts = { 0 };
+         std::atomic<uint64_t> resumes = { 0 };
+         std::atomic<uint64_t> lateHellos = { 0 };
       };
 
       void run();
-      void listen();
-      void manageConnection(ThreadData* data);
-      void pruneThreads();
-
+      void runReactor(Reactor& reactor, bool primary);
       void setCallbacks(Device& device);
-      void updateState(Device& device);
+      void publishEvent(Device& device, const EventPacket& packet, uint64_t timestamp);
+
+      // Pre-encoded packets for every control, which is what a new connection receives first (as EventPackets for version 1 of the protocol, or raw values for version 2)
+      using Snapshot = std::array<uint8_t, kNumControls * sizeof(EventPacket)>;
+      using CompactSnapshot = std::array<uint8_t, kNumControls>;
+      uint64_t copySnapshot(Snapshot& destination) const;
+      uint64_t copySnapshot(CompactSnapshot& destination) const;
 
       const Settings settings;
       const std::optional<std::filesystem::path> stateFilePath;
 
+      // Identifies this run of the server, since sequence numbers start over whenever it restarts
+      const uint64_t epoch;
+
       using Clock = std::chrono::steady_clock;
       using TimePoint = std::chrono::time_point<Clock>;
 
@@ -121,14 +178,31 @@ namespace Kontroller
       TimePoint lastFileUpdateTime;
       mutable std::mutex stateMutex;
 
+      Snapshot snapshot = {};
+      CompactSnapshot compactSnapshot = {};
+      uint64_t snapshotSequence = 0;
+
+      // Also only written while holding the state mutex
+      std::unique_ptr<SharedMemory> sharedState;
+      SharedStateBlock* sharedStateBlock = nullptr;
+      std::unique_ptr<SharedMemory> sharedEvents;
+      SharedEventBlock* sharedEventBlock = nullptr;
+
+      // Every event, in the order the device produced it (shared by all connections, which each keep their own read cursor)
+      static constexpr std::size_t kEventRingCapacity = 4096;
+      std::unique_ptr<EventRing<kEventRingCapacity>> eventRing;
+
       std::condition_variable cv;
       std::mutex shutDownMutex;
       std::atomic_bool shuttingDown = { false };
 
-      std::thread listenThread;
+      std::thread thread;
       std::atomic_bool listening = { false };
 
-      std::vector<std::unique_ptr<ThreadData>> threadData;
-      std::mutex threadDataMutex;
+      std::vector<std::unique_ptr<Reactor>> reactors;
+      mutable std::mutex connectionsMutex;
+
+      // Keyed by address, entries are never removed (connections keep a pointer to theirs), protected by connectionsMutex
+      std::map<std::string, ClientCounters> clientCounters;
    };
 }
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "Kontroller/Packet.h"
+#include "Kontroller/State.h"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace Kontroller
+{
+   class SharedMemory;
+   struct SharedEventBlock;
+   struct SharedStateBlock;
+
+   // Default name of the shared memory block a Server publishes its state into (see Server::Settings::sharedStateName)
+   const char* const kSharedStateName = "/kontroller-state";
+
+   // Default name of the shared memory block a Server publishes its events into (see Server::Settings::sharedEventsName)
+   const char* const kSharedEventsName = "/kontroller-events";
+
+   // Reads the state of a Server running on the same machine directly from shared memory
+   // Reads never block the server, and take no locks (or system calls, other than a check about once a second for a block left behind by a server that crashed)
+   class SharedStateReader
+   {
+   public:
+      SharedStateReader(const char* name = kSharedStateName);
+      ~SharedStateReader();
+
+      // Copies the latest state, returns false if there is no server to read from or no consistent state could be read (in which case the state is left untouched)
+      // The version increases every time the state changes, and the sequence number is that of the last event included in the state
+      bool read(State& state, uint64_t* version = nullptr, uint64_t* lastEventSequence = nullptr);
+
+      // Cheap way to check whether anything has changed since the last read (returns 0 if there is no server to read from)
+      uint64_t getVersion();
+
+   private:
+      bool connect();
+
+      const std::string name;
+      std::unique_ptr<SharedMemory> memory;
+      const SharedStateBlock* block = nullptr;
+      std::chrono::steady_clock::time_point nextReplacementCheck;
+   };
+
+   // Reads every event published by a Server running on the same machine directly from shared memory
+   // Any number of readers can consume events at their own pace, without the server doing any work for them (a reader that falls too far behind misses the oldest events)
+   class SharedEventReader
+   {
+   public:
+      // Starts reading from the next event the server publishes
+      SharedEventReader(const char* name = kSharedEventsName);
+      ~SharedEventReader();
+
+      // Reads the next event (if there is one), along with its sequence number and when the server read it from the device
+      bool read(EventPacket& packet, uint64_t* sequence = nullptr, std::chrono::steady_clock::time_point* timestamp = nullptr);
+
+      // Continues reading from the given sequence number (e.g. one past the last event included in a state read by SharedStateReader)
+      void seek(uint64_t sequence);
+
+      // Number of events that were overwritten before this reader got to them
+      uint64_t getNumMissedEvents() const
+      {
+         return numMissedEvents;
+      }
+
+   private:
+      bool connect();
+
+      const std::string name;
+      std::unique_ptr<SharedMemory> memory;
+      const SharedEventBlock* block = nullptr;
+      std::chrono::steady_clock::time_point nextReplacementCheck;
+
+      uint64_t nextSequence = 0;
+      bool seekPending = false;
+      uint64_t numMissedEvents = 0;
+   };
+}
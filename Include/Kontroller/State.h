@@ -1,10 +1,17 @@
 #pragma once
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
 
 namespace Kontroller
 {
+   constexpr std::size_t kNumButtons = 35;
+   constexpr std::size_t kNumDials = 8;
+   constexpr std::size_t kNumSliders = 8;
+   constexpr std::size_t kNumControls = kNumButtons + kNumDials + kNumSliders;
+   constexpr std::size_t kNumLEDs = 30;
+
    enum class Button : uint8_t
    {
       None,
@@ -111,6 +118,14 @@ namespace Kontroller
    const char* getName(Slider slider);
    const char* getName(LED led);
 
+   // LEDs are stored one bit per LED, in enum order (see Device::setLEDs())
+   constexpr uint32_t kAllLEDs = (1u << kNumLEDs) - 1;
+
+   constexpr uint32_t getLEDMask(LED led)
+   {
+      return led == LED::None ? 0 : 1u << (static_cast<uint8_t>(led) - 1);
+   }
+
    struct Group
    {
       float dial = 0.0f;
@@ -146,4 +161,14 @@ namespace Kontroller
       float* getDialPointer(Dial dial);
       float* getSliderPointer(Slider slider);
    };
+
+   // A newer state, along with what changed to get there (see Client::waitForChange() and Device::waitForChange())
+   struct StateChange
+   {
+      State state;
+      uint64_t version = 0;
+
+      // One bit per control that changed (buttons, then dials, then sliders, each in enum order), which can be checked with Subscription(changedControls).contains()
+      uint64_t changedControls = 0;
+   };
 }
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "Kontroller/State.h"
+
+#include <cstdint>
+
+namespace Kontroller
+{
+   // Set of controls that a client wants to receive (see Client::Settings::subscription)
+   // Stored as one bit per control, with buttons first, then dials, then sliders (each in enum order)
+   class Subscription
+   {
+   public:
+      static_assert(kNumControls <= 64, "Control mask is too small");
+      static constexpr uint64_t kAllControls = (1ull << kNumControls) - 1;
+
+      static Subscription all()
+      {
+         return Subscription(kAllControls);
+      }
+
+      static Subscription none()
+      {
+         return Subscription(0);
+      }
+
+      // Subscribes to everything
+      Subscription() = default;
+
+      explicit Subscription(uint64_t controlMask)
+         : mask(controlMask & kAllControls)
+      {
+      }
+
+      Subscription& add(Button button)
+      {
+         mask |= getBit(button);
+         return *this;
+      }
+
+      Subscription& add(Dial dial)
+      {
+         mask |= getBit(dial);
+         return *this;
+      }
+
+      Subscription& add(Slider slider)
+      {
+         mask |= getBit(slider);
+         return *this;
+      }
+
+      Subscription& addButtons()
+      {
+         mask |= (1ull << kNumButtons) - 1;
+         return *this;
+      }
+
+      Subscription& addDials()
+      {
+         mask |= ((1ull << kNumDials) - 1) << kNumButtons;
+         return *this;
+      }
+
+      Subscription& addSliders()
+      {
+         mask |= ((1ull << kNumSliders) - 1) << (kNumButtons + kNumDials);
+         return *this;
+      }
+
+      bool contains(Button button) const
+      {
+         return (mask & getBit(button)) != 0;
+      }
+
+      bool contains(Dial dial) const
+      {
+         return (mask & getBit(dial)) != 0;
+      }
+
+      bool contains(Slider slider) const
+      {
+         return (mask & getBit(slider)) != 0;
+      }
+
+      uint64_t getMask() const
+      {
+         return mask;
+      }
+
+      bool operator==(const Subscription& other) const
+      {
+         return mask == other.mask;
+      }
+
+      bool operator!=(const Subscription& other) const
+      {
+         return mask != other.mask;
+      }
+
+   private:
+      static uint64_t getBit(Button button)
+      {
+         return button == Button::None ? 0 : 1ull << (static_cast<uint8_t>(button) - 1);
+      }
+
+      static uint64_t getBit(Dial dial)
+      {
+         return dial == Dial::None ? 0 : 1ull << (kNumButtons + static_cast<uint8_t>(dial) - 1);
+      }
+
+      static uint64_t getBit(Slider slider)
+      {
+         return slider == Slider::None ? 0 : 1ull << (kNumButtons + kNumDials + static_cast<uint8_t>(slider) - 1);
+      }
+
+      uint64_t mask = kAllControls;
+   };
+}
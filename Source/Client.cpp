@@ -1,39 +1,40 @@
 #include "Kontroller/Client.h"
 
+#include "EventRing.h"
+#include "Notifier.h"
+#include "Protocol.h"
 #include "Sock.h"
+#include "StateLock.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <optional>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace Kontroller
 {
    namespace
    {
-      Sock::Socket connect(const char* endpoint, int timeoutMS, bool printErrors)
+      const char* const kUnixEndpointPrefix = "unix:";
+
+      // Heartbeats can be sent to a server that has already gone away, which should be reported as an error rather than raise SIGPIPE
+#if defined(MSG_NOSIGNAL)
+      constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+      constexpr int kSendFlags = 0;
+#endif
+
+      Sock::Socket connectTo(const sockaddr* address, socklen_t addressLength, int protocol, int timeoutMS, bool printErrors)
       {
          Sock::Socket socket = Sock::kInvalidSocket;
-         addrinfo* addrInfo = nullptr;
          bool success = false;
 
          do 
          {
-            addrinfo hints = {};
-            hints.ai_family = AF_INET;
-            hints.ai_socktype = SOCK_STREAM;
-            hints.ai_protocol = IPPROTO_TCP;
-
-            int addrInfoResult = Sock::getaddrinfo(endpoint, kPort, &hints, &addrInfo);
-            if (addrInfoResult != 0 || !addrInfo)
-            {
-               if (printErrors)
-               {
-                  fprintf(stderr, "Kontroller::Client - getaddrinfo failed with error: %d\n", addrInfoResult);
-               }
-               break;
-            }
-
-            socket = Sock::socket(addrInfo->ai_family, addrInfo->ai_socktype, addrInfo->ai_protocol);
+            socket = Sock::socket(address->sa_family, SOCK_STREAM, protocol);
             if (socket == Sock::kInvalidSocket)
             {
                if (printErrors)
@@ -54,7 +55,12 @@ namespace Kontroller
                break;
             }
 
-            int connectResult = Sock::connect(socket, addrInfo->ai_addr, static_cast<socklen_t>(addrInfo->ai_addrlen));
+#if defined(SO_NOSIGPIPE)
+            int noSigPipe = 1;
+            Sock::setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+
+            int connectResult = Sock::connect(socket, address, addressLength);
             if (connectResult == Sock::kSocketError)
             {
                int error = Sock::System::getLastError();
@@ -68,8 +74,8 @@ namespace Kontroller
                }
             }
 
-            // Poll to make sure a connection has successfully been made
-            Sock::Result pollResult = Sock::Helpers::poll(socket, POLLRDNORM, timeoutMS, "Kontroller::Client", printErrors);
+            // Poll to make sure a connection has successfully been made (servers that speak version 2 of the protocol wait for a hello before sending anything)
+            Sock::Result pollResult = Sock::Helpers::poll(socket, POLLWRNORM, timeoutMS, "Kontroller::Client", printErrors);
             if (pollResult != Sock::Result::Success)
             {
                break;
@@ -78,12 +84,6 @@ namespace Kontroller
             success = true;
          } while (false);
 
-         if (addrInfo)
-         {
-            Sock::freeaddrinfo(addrInfo);
-            addrInfo = nullptr;
-         }
-
          if (socket != Sock::kInvalidSocket && !success)
          {
             Sock::shutdown(socket, Sock::ShutdownMethod::ReadWrite);
@@ -94,80 +94,232 @@ namespace Kontroller
          return socket;
       }
 
-      bool receiveData(Sock::Socket socket, uint8_t* data, size_t size, bool printErrors)
+      Sock::Socket connectUnix(const char* path, int timeoutMS, bool printErrors)
       {
-         size_t bytesRead = 0;
+#if SOCK_UNIX_DOMAIN
+         sockaddr_un address;
+         socklen_t addressLength = 0;
+         if (!Sock::Helpers::makeUnixAddress(*path ? path : kUnixSocketPath, address, addressLength))
+         {
+            if (printErrors)
+            {
+               fprintf(stderr, "Kontroller::Client - invalid unix socket path: %s\n", path);
+            }
+            return Sock::kInvalidSocket;
+         }
+
+         return connectTo(reinterpret_cast<sockaddr*>(&address), addressLength, 0, timeoutMS, printErrors);
+#else
+         if (printErrors)
+         {
+            fprintf(stderr, "Kontroller::Client - unix domain sockets are not supported on this platform\n");
+         }
+         return Sock::kInvalidSocket;
+#endif
+      }
+
+      Sock::Socket connect(const char* endpoint, int timeoutMS, bool printErrors)
+      {
+         // Endpoints of the form "unix:/path/to/socket" (or just "unix:" for the default path) connect to a server on the same machine
+         std::size_t prefixLength = strlen(kUnixEndpointPrefix);
+         if (strncmp(endpoint, kUnixEndpointPrefix, prefixLength) == 0)
+         {
+            return connectUnix(endpoint + prefixLength, timeoutMS, printErrors);
+         }
 
-         while (bytesRead < size)
+         addrinfo hints = {};
+         hints.ai_family = AF_INET;
+         hints.ai_socktype = SOCK_STREAM;
+         hints.ai_protocol = IPPROTO_TCP;
+
+         addrinfo* addrInfo = nullptr;
+         int addrInfoResult = Sock::getaddrinfo(endpoint, kPort, &hints, &addrInfo);
+         if (addrInfoResult != 0 || !addrInfo)
          {
-            Sock::SignedResult result = Sock::recv(socket, data + bytesRead, static_cast<Sock::Length>(size - bytesRead), 0);
-            if (result <= 0)
+            if (printErrors)
             {
-               // Connection lost
-               if (printErrors)
-               {
-                  fprintf(stderr, "Kontroller::Client - recv failed with error: %d\n", Sock::System::getLastError());
-               }
-               return false;
+               fprintf(stderr, "Kontroller::Client - getaddrinfo failed with error: %d\n", addrInfoResult);
             }
 
-            bytesRead += result;
+            if (addrInfo)
+            {
+               Sock::freeaddrinfo(addrInfo);
+            }
+            return Sock::kInvalidSocket;
+         }
+
+         Sock::Socket socket = connectTo(addrInfo->ai_addr, static_cast<socklen_t>(addrInfo->ai_addrlen), addrInfo->ai_protocol, timeoutMS, printErrors);
+         Sock::freeaddrinfo(addrInfo);
+
+         return socket;
+      }
+
+      // Only used for small messages, which always fit in the socket's send buffer (the client never sends much)
+      bool sendData(Sock::Socket socket, const std::vector<uint8_t>& data, bool printErrors)
+      {
+         Sock::SignedResult result = Sock::send(socket, data.data(), static_cast<Sock::Length>(data.size()), kSendFlags);
+         if (result != static_cast<Sock::SignedResult>(data.size()))
+         {
+            if (printErrors)
+            {
+               fprintf(stderr, "Kontroller::Client - send failed with error: %d\n", Sock::System::getLastError());
+            }
+            return false;
          }
 
          return true;
       }
 
-      Sock::Result receivePacket(Sock::Socket socket, EventPacket& packet, int timeoutMS, bool printErrors)
+      bool sendHello(Sock::Socket socket, const Subscription& subscription, int maxUpdateRate, const std::optional<std::pair<uint64_t, uint64_t>>& resumeFrom, bool printErrors)
       {
-         // Wait (with timeout) until there is data available
-         Sock::Result pollResult = Sock::Helpers::poll(socket, POLLRDNORM, timeoutMS, "Kontroller::Client", printErrors);
-         if (pollResult != Sock::Result::Success)
+         std::vector<uint8_t> hello(Protocol::kMagic.begin(), Protocol::kMagic.end());
+         std::size_t frameOffset = Protocol::beginFrame(hello, Protocol::FrameType::Hello);
+         hello.push_back(Protocol::kVersion);
+         Protocol::appendUint32(hello, Protocol::kCapabilityTimedEvents | Protocol::kCapabilityHeartbeats | Protocol::kCapabilityResume);
+         Protocol::appendUint64(hello, subscription.getMask());
+         uint16_t updateRate = static_cast<uint16_t>(std::clamp(maxUpdateRate, 0, 0xFFFF));
+         hello.push_back(static_cast<uint8_t>(updateRate >> 8));
+         hello.push_back(static_cast<uint8_t>(updateRate));
+         if (resumeFrom.has_value())
          {
-            return pollResult;
+            Protocol::appendUint64(hello, resumeFrom->first);
+            Protocol::appendUint64(hello, resumeFrom->second);
          }
+         Protocol::endFrame(hello, frameOffset);
+
+         return sendData(socket, hello, printErrors);
+      }
+
+      bool sendSubscription(Sock::Socket socket, const Subscription& subscription, bool printErrors)
+      {
+         std::vector<uint8_t> frame;
+         std::size_t frameOffset = Protocol::beginFrame(frame, Protocol::FrameType::Subscribe);
+         Protocol::appendUint64(frame, subscription.getMask());
+         Protocol::endFrame(frame, frameOffset);
+
+         return sendData(socket, frame, printErrors);
+      }
+
+      bool sendHeartbeat(Sock::Socket socket, bool printErrors)
+      {
+         std::vector<uint8_t> frame;
+         std::size_t frameOffset = Protocol::beginFrame(frame, Protocol::FrameType::Heartbeat);
+         Protocol::endFrame(frame, frameOffset);
+
+         return sendData(socket, frame, printErrors);
+      }
 
-         // Make sure there is at least one full packet's worth of data available
-         EventPacket dummyPacket;
-         Sock::SignedResult bytesReady = Sock::recv(socket, &dummyPacket, sizeof(dummyPacket), MSG_PEEK);
-         if (bytesReady < 0)
+      // Data received from the server that hasn't been processed yet, a partial frame (or packet) at the end is carried over to the next read
+      class ReceiveBuffer
+      {
+      public:
+         const uint8_t* data() const
          {
-            int error = Sock::System::getLastError();
-            if (error != Sock::WouldBlock)
-            {
-               return Sock::Result::Error;
-            }
+            return storage.data() + start;
          }
-         else if (bytesReady == 0)
+
+         std::size_t size() const
          {
-            // Socket shut down by server
-            return Sock::Result::Error;
+            return end - start;
          }
-         else if (bytesReady != sizeof(EventPacket))
+
+         void consume(std::size_t numBytes)
          {
-            return Sock::Result::Timeout;
+            start += std::min(numBytes, size());
+            if (start == end)
+            {
+               start = end = 0;
+            }
          }
 
-         // Read the data
-         EventPacket networkPacket;
-         if (!receiveData(socket, reinterpret_cast<uint8_t*>(&networkPacket), sizeof(networkPacket), printErrors))
+         // Reads as much as is available in a single recv() (only waiting, with timeout, if the previous read didn't fill the buffer)
+         Sock::Result receive(Sock::Socket socket, int timeoutMS, bool printErrors)
          {
+            if (!moreAvailable)
+            {
+               Sock::Result pollResult = Sock::Helpers::poll(socket, POLLRDNORM, timeoutMS, "Kontroller::Client", printErrors);
+               if (pollResult != Sock::Result::Success)
+               {
+                  return pollResult;
+               }
+            }
+
+            uint8_t* destination = prepare(kReadSize);
+            Sock::SignedResult result = Sock::recv(socket, destination, static_cast<Sock::Length>(kReadSize), 0);
+            if (result > 0)
+            {
+               end += result;
+               moreAvailable = static_cast<std::size_t>(result) == kReadSize;
+               return Sock::Result::Success;
+            }
+
+            moreAvailable = false;
+            if (result < 0 && Sock::System::getLastError() == Sock::WouldBlock)
+            {
+               return Sock::Result::Timeout;
+            }
+
+            // Connection lost (or shut down by server)
+            if (printErrors && result < 0)
+            {
+               fprintf(stderr, "Kontroller::Client - recv failed with error: %d\n", Sock::System::getLastError());
+            }
             return Sock::Result::Error;
          }
 
-         // Translate from network byte order to host byte order
-         packet.type = Sock::Endian::networkToHostShort(networkPacket.type);
-         packet.id = Sock::Endian::networkToHostShort(networkPacket.id);
-         packet.value = Sock::Endian::networkToHostLong(networkPacket.value);
-         return Sock::Result::Success;
+      private:
+         // Large enough for a whole burst of events (and for a full write from the server to fit) in one read
+         static constexpr std::size_t kReadSize = 64 * 1024;
+
+         // Moves the unprocessed tail (at most a partial frame) to the front, the storage only ever grows so it is only allocated once
+         uint8_t* prepare(std::size_t numBytes)
+         {
+            if (start > 0)
+            {
+               std::memmove(storage.data(), storage.data() + start, end - start);
+               end -= start;
+               start = 0;
+            }
+            if (storage.size() < end + numBytes)
+            {
+               storage.resize(end + numBytes);
+            }
+
+            return storage.data() + end;
+         }
+
+         std::vector<uint8_t> storage;
+         std::size_t start = 0;
+         std::size_t end = 0;
+         bool moreAvailable = false;
+      };
+   }
+
+   Client::Client(const Settings& clientSettings)
+      : timeoutMS(clientSettings.timeoutMilliseconds)
+      , retryMS(clientSettings.retryMilliseconds)
+      , printErrors(clientSettings.printErrorMessages)
+      , maxUpdateRate(clientSettings.maxUpdateRate)
+      , subscription(clientSettings.subscription)
+      , stateLock(std::make_unique<StateLock>())
+      , notifier(std::make_unique<Notifier>())
+   {
+      if (clientSettings.eventQueueCapacity > 0)
+      {
+         eventQueue = std::make_unique<moodycamel::ReaderWriterQueue<Event>>(clientSettings.eventQueueCapacity);
       }
+
+      thread = std::thread([this, endpoint = clientSettings.endpoint]() { run(endpoint); });
    }
 
    Client::Client(const char* endpoint /*= "127.0.0.1"*/, int timeoutMilliseconds /*= 100*/, int retryMilliseconds /*= 1000*/, bool printErrorMessages /*= false*/)
       : timeoutMS(timeoutMilliseconds)
       , retryMS(retryMilliseconds)
       , printErrors(printErrorMessages)
+      , stateLock(std::make_unique<StateLock>())
+      , notifier(std::make_unique<Notifier>())
    {
-      thread = std::thread([this, endpointString = std::string(endpoint)]() { run(endpointString.c_str()); });
+      thread = std::thread([this, endpointString = std::string(endpoint)]() { run(endpointString); });
    }
 
    Client::~Client()
@@ -180,12 +332,38 @@ namespace Kontroller
       thread.join();
    }
 
-   Kontroller::State Client::getState() const
+   Kontroller::State Client::getState(uint64_t* version /*= nullptr*/) const
    {
-      std::lock_guard<std::mutex> lock(stateMutex);
+      State state;
+      uint64_t readVersion = stateLock->read(state);
+      if (version)
+      {
+         *version = readVersion;
+      }
+
       return state;
    }
 
+   uint64_t Client::getStateVersion() const
+   {
+      return stateLock->getVersion();
+   }
+
+   std::optional<StateChange> Client::waitForChange(uint64_t lastVersion, std::chrono::milliseconds timeout) const
+   {
+      if (!stateLock->waitForChange(lastVersion, timeout))
+      {
+         return std::nullopt;
+      }
+
+      // Read before the change mask, so that the mask covers everything in the state (and possibly a little more)
+      StateChange change;
+      change.version = stateLock->read(change.state);
+      change.changedControls = stateLock->getChangedControls(lastVersion);
+
+      return change;
+   }
+
    void Client::setButtonCallback(ButtonCallback callback)
    {
       std::lock_guard<std::recursive_mutex> lock(callbackMutex);
@@ -219,7 +397,66 @@ namespace Kontroller
       setSliderCallback({});
    }
 
-   void Client::run(const char* endpoint)
+   void Client::setEventCallback(EventCallback callback)
+   {
+      std::lock_guard<std::recursive_mutex> lock(callbackMutex);
+      eventCallback = std::move(callback);
+   }
+
+   void Client::clearEventCallback()
+   {
+      setEventCallback({});
+   }
+
+   std::size_t Client::pollEvents(Event* events, std::size_t maxEvents)
+   {
+      std::size_t numEvents = 0;
+      while (eventQueue && numEvents < maxEvents && eventQueue->try_dequeue(events[numEvents]))
+      {
+         ++numEvents;
+      }
+
+      return numEvents;
+   }
+
+   NotificationHandle Client::getNotificationHandle() const
+   {
+      return notifier->getHandle();
+   }
+
+   void Client::clearNotification()
+   {
+      notifier->clear();
+   }
+
+   void Client::setSyncCallback(SyncCallback callback)
+   {
+      std::lock_guard<std::recursive_mutex> lock(callbackMutex);
+      syncCallback = std::move(callback);
+   }
+
+   void Client::clearSyncCallback()
+   {
+      setSyncCallback({});
+   }
+
+   void Client::setSubscription(const Subscription& newSubscription)
+   {
+      {
+         std::lock_guard<std::mutex> lock(subscriptionMutex);
+         subscription = newSubscription;
+      }
+
+      subscriptionChanged.store(true);
+   }
+
+   Subscription Client::getSubscription() const
+   {
+      std::lock_guard<std::mutex> lock(subscriptionMutex);
+      return subscription;
+   }
+
+   void Client::run(const std::string& endpoint)
    {
       int initializeResult = -1;
       while (initializeResult != 0 && !shuttingDown.load())
@@ -243,7 +480,7 @@ namespace Kontroller
 
       while (!shuttingDown.load())
       {
-         Sock::Socket socket = connect(endpoint, timeoutMS, printErrors);
+         Sock::Socket socket = connect(endpoint.c_str(), timeoutMS, printErrors);
          if (socket == Sock::kInvalidSocket)
          {
             std::unique_lock<std::mutex> lock(shutDownMutex);
@@ -255,21 +492,83 @@ namespace Kontroller
             continue;
          }
 
+         // Version 1 servers ignore the hello, and are detected by the first byte they send
+         Session session;
+         ReceiveBuffer receiveBuffer;
+         subscriptionChanged.store(false);
+
+         // Events the client missed while disconnected can only be caught up on if it still wants the same controls
+         Subscription helloSubscription = getSubscription();
+         std::optional<std::pair<uint64_t, uint64_t>> resumeFrom;
+         if (resumePoint.valid && resumePoint.subscription == helloSubscription.getMask())
+         {
+            resumeFrom = std::make_pair(resumePoint.epoch, resumePoint.sequence);
+         }
+         session.subscription = helloSubscription.getMask();
+
+         if (!sendHello(socket, helloSubscription, maxUpdateRate, resumeFrom, printErrors))
+         {
+            Sock::shutdown(socket, Sock::ShutdownMethod::ReadWrite);
+            Sock::close(socket);
+
+            // Same as a failed connection, so that a server that accepts and then resets connections doesn't keep us spinning
+            std::unique_lock<std::mutex> lock(shutDownMutex);
+            cv.wait_for(lock, std::chrono::milliseconds(retryMS), [this]
+            {
+               return shuttingDown.load();
+            });
+
+            continue;
+         }
          connected.store(true);
 
-         while (!shuttingDown.load())
+         std::chrono::steady_clock::time_point lastReceiveTime = std::chrono::steady_clock::now();
+         std::chrono::steady_clock::time_point lastSendTime = lastReceiveTime;
+         while (!shuttingDown.load() && connected.load())
          {
-            EventPacket packet;
-            Sock::Result result = receivePacket(socket, packet, timeoutMS, printErrors);
+            if (subscriptionChanged.exchange(false))
+            {
+               if (!sendSubscription(socket, getSubscription(), printErrors))
+               {
+                  break;
+               }
+               lastSendTime = std::chrono::steady_clock::now();
+            }
+
+            // Wake up often enough to send heartbeats on time
+            int receiveTimeoutMS = session.heartbeatMilliseconds > 0 ? std::min(timeoutMS, session.heartbeatMilliseconds) : timeoutMS;
+            Sock::Result result = receiveBuffer.receive(socket, receiveTimeoutMS, printErrors);
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
 
             if (result == Sock::Result::Success)
             {
-               updateState(packet);
+               lastReceiveTime = now;
+
+               receiveBuffer.consume(processData(receiveBuffer.data(), receiveBuffer.size(), session));
             }
             else if (result == Sock::Result::Error)
             {
                break;
             }
+
+            // A server that sends heartbeats is never quiet for long, so silence means that it (or the network) is gone
+            if (session.idleTimeoutMilliseconds > 0 && now - lastReceiveTime > std::chrono::milliseconds(session.idleTimeoutMilliseconds))
+            {
+               if (printErrors)
+               {
+                  fprintf(stderr, "Kontroller::Client - nothing received from the server in %d ms, reconnecting\n", session.idleTimeoutMilliseconds);
+               }
+               break;
+            }
+
+            if (session.heartbeatMilliseconds > 0 && now - lastSendTime >= std::chrono::milliseconds(session.heartbeatMilliseconds))
+            {
+               if (!sendHeartbeat(socket, printErrors))
+               {
+                  break;
+               }
+               lastSendTime = now;
+            }
          }
 
          connected.store(false);
@@ -284,42 +583,207 @@ namespace Kontroller
       }
    }
 
-   void Client::updateState(const EventPacket& packet)
+   std::size_t Client::processData(const uint8_t* data, std::size_t size, Session& session)
    {
-      static_assert(sizeof(packet.value) == sizeof(float), "Packet data size does not match event data size");
+      if (session.protocolVersion == 0 && size > 0)
+      {
+         session.protocolVersion = data[0] == 0 ? 1 : Protocol::kVersion;
+      }
 
-      bool boolValue = packet.value != 0;
-      float floatValue = 0.0f;
-      std::memcpy(&floatValue, &packet.value, sizeof(floatValue));
+      std::size_t offset = 0;
+      if (session.protocolVersion == 1)
+      {
+         while (size - offset >= sizeof(EventPacket))
+         {
+            EventPacket networkPacket;
+            std::memcpy(&networkPacket, data + offset, sizeof(networkPacket));
+            offset += sizeof(networkPacket);
+
+            // Translate from network byte order to host byte order
+            EventPacket packet;
+            packet.type = Sock::Endian::networkToHostShort(networkPacket.type);
+            packet.id = Sock::Endian::networkToHostShort(networkPacket.id);
+            packet.value = Sock::Endian::networkToHostLong(networkPacket.value);
+            updateState(packet);
+         }
+
+         return offset;
+      }
 
+      Protocol::Frame frame;
+      while (std::size_t frameSize = Protocol::parseFrame(data + offset, size - offset, frame))
       {
-         std::lock_guard<std::mutex> lock(stateMutex);
+         offset += frameSize;
 
-         switch (packet.type)
+         switch (frame.type)
          {
-         case EventPacket::Button:
-            if (bool* buttonPointer = state.getButtonPointer(static_cast<Button>(packet.id)))
+         case Protocol::FrameType::Welcome:
+            if (frame.payloadSize >= 9 && (Protocol::readUint32(frame.payload + 1) & Protocol::kCapabilityHeartbeats))
             {
-               *buttonPointer = boolValue;
+               session.heartbeatMilliseconds = (frame.payload[5] << 8) | frame.payload[6];
+               session.idleTimeoutMilliseconds = (frame.payload[7] << 8) | frame.payload[8];
             }
             break;
-         case EventPacket::Dial:
-            if (float* dialPointer = state.getDialPointer(static_cast<Dial>(packet.id)))
+         case Protocol::FrameType::State:
+            for (std::size_t i = 0; i < frame.payloadSize; ++i)
             {
-               *dialPointer = floatValue;
+               if (std::optional<EventPacket> packet = Protocol::makePacket(static_cast<uint8_t>(i), frame.payload[i]))
+               {
+                  updateState(packet.value());
+               }
             }
+            session.subscription = Subscription::kAllControls;
+            notifySync(SyncType::Snapshot);
             break;
-         case EventPacket::Slider:
-            if (float* sliderPointer = state.getSliderPointer(static_cast<Slider>(packet.id)))
+         case Protocol::FrameType::PartialState:
+            if (frame.payloadSize >= 8)
+            {
+               uint64_t mask = Protocol::readUint64(frame.payload);
+               std::size_t valueOffset = 8;
+               for (uint8_t i = 0; i < kNumControls && valueOffset < frame.payloadSize; ++i)
+               {
+                  if (mask & (1ull << i))
+                  {
+                     if (std::optional<EventPacket> packet = Protocol::makePacket(i, frame.payload[valueOffset]))
+                     {
+                        updateState(packet.value());
+                     }
+                     ++valueOffset;
+                  }
+               }
+               session.subscription = mask;
+               notifySync(SyncType::Snapshot);
+            }
+            break;
+         case Protocol::FrameType::Events:
+            for (std::size_t i = 0; i + Protocol::kCompactEventSize <= frame.payloadSize; i += Protocol::kCompactEventSize)
+            {
+               if (std::optional<EventPacket> packet = Protocol::makePacket(frame.payload[i], frame.payload[i + 1]))
+               {
+                  updateState(packet.value());
+               }
+            }
+            break;
+         case Protocol::FrameType::TimedEvents:
+         {
+            uint64_t sequence = 0;
+            uint64_t newestSequence = 0;
+            uint64_t timestamp = 0;
+            std::size_t i = 0;
+            while (i + Protocol::kCompactEventSize <= frame.payloadSize)
+            {
+               int64_t sequenceDelta = 0;
+               int64_t timestampDelta = 0;
+               std::size_t sequenceSize = Protocol::readVarint(frame.payload + i + Protocol::kCompactEventSize, frame.payloadSize - i - Protocol::kCompactEventSize, sequenceDelta);
+               std::size_t timestampSize = sequenceSize == 0 ? 0 : Protocol::readVarint(frame.payload + i + Protocol::kCompactEventSize + sequenceSize, frame.payloadSize - i - Protocol::kCompactEventSize - sequenceSize, timestampDelta);
+               if (timestampSize == 0)
+               {
+                  break;
+               }
+
+               sequence += static_cast<uint64_t>(sequenceDelta);
+               newestSequence = std::max(newestSequence, sequence);
+               timestamp += static_cast<uint64_t>(timestampDelta);
+               if (std::optional<EventPacket> packet = Protocol::makePacket(frame.payload[i], frame.payload[i + 1]))
+               {
+                  updateState(packet.value(), sequence, fromTimestamp(timestamp));
+               }
+
+               i += Protocol::kCompactEventSize + sequenceSize + timestampSize;
+            }
+
+            // Frames are handled as a whole, so every event up to the newest one in the frame has been seen (conflated events can arrive out of order, but only ever within a frame)
+            if (resumePoint.valid)
+            {
+               resumePoint.sequence = std::max(resumePoint.sequence, newestSequence);
+            }
+            break;
+         }
+         case Protocol::FrameType::Sync:
+            if (frame.payloadSize >= Protocol::kSyncPayloadSize)
             {
-               *sliderPointer = floatValue;
+               resumePoint.valid = true;
+               resumePoint.epoch = Protocol::readUint64(frame.payload + 1);
+               resumePoint.sequence = Protocol::readUint64(frame.payload + 9);
+               resumePoint.subscription = session.subscription;
+
+               // Snapshots were already reported when their state arrived
+               if (frame.payload[0] == static_cast<uint8_t>(Protocol::SyncType::Delta))
+               {
+                  notifySync(SyncType::Delta);
+               }
             }
             break;
          default:
+            // Heartbeats only matter for having arrived at all, and unknown frames are skipped so that newer servers can send more
             break;
          }
       }
 
+      return offset;
+   }
+
+   void Client::notifySync(SyncType type)
+   {
+      std::lock_guard<std::recursive_mutex> lock(callbackMutex);
+      if (syncCallback)
+      {
+         syncCallback(type);
+      }
+   }
+
+   void Client::updateState(const EventPacket& packet, uint64_t sequence /*= 0*/, std::chrono::steady_clock::time_point timestamp /*= {}*/)
+   {
+      static_assert(sizeof(packet.value) == sizeof(float), "Packet data size does not match event data size");
+
+      bool boolValue = packet.value != 0;
+      float floatValue = 0.0f;
+      std::memcpy(&floatValue, &packet.value, sizeof(floatValue));
+
+      switch (packet.type)
+      {
+      case EventPacket::Button:
+         stateLock->set(static_cast<Button>(packet.id), boolValue);
+         break;
+      case EventPacket::Dial:
+         stateLock->set(static_cast<Dial>(packet.id), floatValue);
+         break;
+      case EventPacket::Slider:
+         stateLock->set(static_cast<Slider>(packet.id), floatValue);
+         break;
+      default:
+         break;
+      }
+
+      Event event;
+      event.sequence = sequence;
+      event.timestamp = timestamp;
+
+      switch (packet.type)
+      {
+      case EventPacket::Button:
+         event.button = static_cast<Button>(packet.id);
+         event.pressed = boolValue;
+         break;
+      case EventPacket::Dial:
+         event.dial = static_cast<Dial>(packet.id);
+         event.value = floatValue;
+         break;
+      case EventPacket::Slider:
+         event.slider = static_cast<Slider>(packet.id);
+         event.value = floatValue;
+         break;
+      default:
+         break;
+      }
+
+      // The queue is bounded (and never allocates), so events that don't fit are dropped rather than waiting for the reader
+      if (eventQueue && !eventQueue->try_enqueue(event))
+      {
+         ++numDroppedEvents;
+      }
+      notifier->notify();
+
       {
          std::lock_guard<std::recursive_mutex> lock(callbackMutex);
 
@@ -346,6 +810,11 @@ namespace Kontroller
          default:
             break;
          }
+
+         if (eventCallback)
+         {
+            eventCallback(event);
+         }
       }
    }
 }
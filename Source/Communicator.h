@@ -4,6 +4,7 @@
 
 #include <array>
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <memory>
 
@@ -30,6 +31,13 @@ namespace Kontroller
       void disconnect();
       void poll();
 
+      // Whether input is read on the device's thread (in waitForInput()), rather than on a thread of the communicator's own
+      static const bool kReadsOnDeviceThread;
+
+      // Blocks until input has been read (and passed to onMessageReceived()), the device's wakeup notifier is notified, or the timeout expires
+      // Only used if kReadsOnDeviceThread is set, and also called while disconnected (in which case it only waits for the notifier)
+      void waitForInput(std::chrono::milliseconds timeout);
+
       bool initializeMessage();
 
       template<size_t NumBytes>
@@ -42,9 +50,10 @@ namespace Kontroller
 
       bool finalizeMessage();
 
-      void onMessageReceived(uint8_t id, uint8_t value)
+      // The timestamp should be taken as close as possible to when the data was read from the device
+      void onMessageReceived(uint8_t id, uint8_t value, std::chrono::steady_clock::time_point timestamp)
       {
-         device.queueMessage(id, value);
+         device.receiveMessage(id, value, timestamp);
       }
 
       void onConnectionLost()
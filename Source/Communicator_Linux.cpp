@@ -1,49 +1,103 @@
 #include "Communicator.h"
+#include "MidiParser.h"
+#include "Notifier.h"
+#include "Poller.h"
 
 #include <alsa/asoundlib.h>
 
-#include <fcntl.h>
-#include <poll.h>
+#include <sys/inotify.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <array>
-#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
-#include <thread>
+
+// Kernel timestamps for MIDI input need alsa-lib 1.2.6 (and a 5.14 kernel, which is checked when connecting)
+#if KONTROLLER_MIDI_TIMESTAMPS && defined(SND_LIB_VERSION) && SND_LIB_VERSION >= 0x010206
+#  define MIDI_TIMESTAMPS 1
+#else
+#  define MIDI_TIMESTAMPS 0
+#endif
 
 namespace Kontroller
 {
    namespace
    {
-      void readThreadRun(Device::Communicator& communicator, snd_rawmidi_t* midiInput, pollfd midiPollData, int pipeReadDescriptor, std::atomic_bool& shuttingDown)
+      // Large enough to hold everything that arrives during a fast sweep of several sliders, so that it can be taken in a single read
+      constexpr std::size_t kReadBufferSize = 1024;
+
+      // The MIDI input, the device watcher, and the device's wakeup notifier
+      constexpr int kMaxPollEvents = 3;
+
+      // Device nodes appear before they are fully set up (e.g. before their permissions are set), so keep retrying for a little while after any change
+      constexpr std::chrono::milliseconds kPlugSettleTime(1000);
+      constexpr std::chrono::milliseconds kPlugRetryInterval(50);
+
+      // Notified whenever a sound device is added (or changes), and when /dev/snd itself goes away
+      constexpr uint32_t kSoundWatchMask = IN_CREATE | IN_ATTRIB | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+      // Only used until /dev/snd appears
+      constexpr uint32_t kDevWatchMask = IN_CREATE | IN_MOVED_TO | IN_ONLYDIR;
+      constexpr const char* kSoundDirectoryName = "snd";
+
+      // Watches /dev/snd if it exists, and otherwise /dev (to find out when it does), returns true if /dev/snd has just started being watched
+      bool updateWatches(int descriptor, int& soundWatch, int& devWatch)
       {
-         while (!shuttingDown.load())
+         if (soundWatch != -1)
          {
-            std::array<pollfd, 2> pollData;
-            pollData[0] = midiPollData;
-            pollData[1].fd = pipeReadDescriptor;
-            pollData[1].events = POLLRDNORM;
+            return false;
+         }
 
-            int pollResult = poll(pollData.data(), pollData.size(), -1);
-            if (pollResult > 0)
+         soundWatch = inotify_add_watch(descriptor, "/dev/snd", kSoundWatchMask);
+         if (soundWatch == -1)
+         {
+            if (devWatch == -1)
             {
-               if ((pollData[0].revents & POLLIN) != 0 && !shuttingDown.load())
-               {
-                  std::array<uint8_t, 3> data;
-                  ssize_t bytesRead = snd_rawmidi_read(midiInput, data.data(), data.size());
-                  if (bytesRead == data.size() && data[0] == kControlCommand)
-                  {
-                     communicator.onMessageReceived(data[1], data[2]);
-                  }
-               }
-               else if ((pollData[0].revents & POLLERR) != 0)
-               {
-                  communicator.onConnectionLost();
-               }
+               devWatch = inotify_add_watch(descriptor, "/dev", kDevWatchMask);
             }
+            return false;
+         }
+
+         // Everything else that happens in /dev is just noise
+         if (devWatch != -1)
+         {
+            inotify_rm_watch(descriptor, devWatch);
+            devWatch = -1;
          }
+         return true;
       }
+
+#if MIDI_TIMESTAMPS
+      // Has the kernel timestamp input as it arrives, so that any delay before it is read (e.g. from scheduling) is included in its latency
+      bool enableTimestamps(snd_rawmidi_t* midiInput)
+      {
+         snd_rawmidi_params_t* params = nullptr;
+         if (snd_rawmidi_params_malloc(&params) < 0)
+         {
+            return false;
+         }
+
+         // Monotonic, to match std::chrono::steady_clock
+         bool success = snd_rawmidi_params_current(midiInput, params) >= 0
+            && snd_rawmidi_params_set_read_mode(midiInput, params, SND_RAWMIDI_READ_TSTAMP) >= 0
+            && snd_rawmidi_params_set_clock_type(midiInput, params, SND_RAWMIDI_CLOCK_MONOTONIC) >= 0
+            && snd_rawmidi_params(midiInput, params) >= 0;
+
+         snd_rawmidi_params_free(params);
+         return success;
+      }
+
+      std::chrono::steady_clock::time_point toTimePoint(const timespec& time)
+      {
+         // std::chrono::steady_clock is CLOCK_MONOTONIC on Linux
+         std::chrono::nanoseconds sinceEpoch = std::chrono::seconds(time.tv_sec) + std::chrono::nanoseconds(time.tv_nsec);
+         return std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(sinceEpoch));
+      }
+#endif
    }
 
    struct Device::Communicator::ImplData
@@ -51,21 +105,57 @@ namespace Kontroller
       snd_rawmidi_t* midiInput = nullptr;
       snd_rawmidi_t* midiOutput = nullptr;
       pollfd pollData = {};
-      int pipeReadDescriptor = -1;
-      int pipeWriteDescriptor = -1;
-      std::thread readThread;
-      std::atomic_bool shuttingDown;
+      bool polling = false;
+
+      // Whether input is read along with the time the kernel received it
+      bool timestamped = false;
+
+      // Waits for input and for the device's wakeup notifier together, so that input is read and processed on the device's thread
+      Poller poller;
+
+      // While disconnected, the device is only probed after something changes in /dev/snd (or periodically, while /dev/snd can't be watched)
+      int watchDescriptor = -1;
+      int soundWatch = -1;
+      int devWatch = -1;
+      bool devicesChanged = true;
+      std::chrono::steady_clock::time_point settleDeadline;
+
+      // The device may use running status, and reads may end part way through a message, so the parser keeps its state between reads
+      MidiParser parser;
+      std::array<uint8_t, kReadBufferSize> readBuffer;
    };
 
+   // static
+   const bool Device::Communicator::kReadsOnDeviceThread = true;
+
    Device::Communicator::Communicator(Device& owningDevice)
       : device(owningDevice)
       , implData(std::make_unique<ImplData>())
    {
+      // Stays registered for the communicator's lifetime, only the MIDI input comes and goes with the connection
+      implData->poller.add(device.wakeNotifier->getHandle(), Poller::Readable, nullptr);
+
+      implData->watchDescriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (implData->watchDescriptor != -1 && !implData->poller.add(implData->watchDescriptor, Poller::Readable, &implData->watchDescriptor))
+      {
+         close(implData->watchDescriptor);
+         implData->watchDescriptor = -1;
+      }
+
+      if (implData->watchDescriptor != -1)
+      {
+         updateWatches(implData->watchDescriptor, implData->soundWatch, implData->devWatch);
+      }
    }
 
    Device::Communicator::~Communicator()
    {
       disconnect();
+
+      if (implData->watchDescriptor != -1)
+      {
+         close(implData->watchDescriptor);
+      }
    }
 
    bool Device::Communicator::isConnected() const
@@ -80,6 +170,20 @@ namespace Kontroller
          return true;
       }
 
+      // In case /dev/snd appeared without us noticing (e.g. if /dev couldn't be watched either)
+      if (implData->watchDescriptor != -1 && updateWatches(implData->watchDescriptor, implData->soundWatch, implData->devWatch))
+      {
+         implData->devicesChanged = true;
+      }
+
+      // Nothing has been plugged in since the last attempt
+      bool watching = implData->soundWatch != -1;
+      if (watching && !implData->devicesChanged && std::chrono::steady_clock::now() >= implData->settleDeadline)
+      {
+         return false;
+      }
+      implData->devicesChanged = false;
+
       std::array<char, 32> portName{};
       std::snprintf(portName.data(), portName.size(), "hw:%s,0", Device::kDeviceName);
 
@@ -89,23 +193,21 @@ namespace Kontroller
          int numPollDescriptors = snd_rawmidi_poll_descriptors(implData->midiInput, &implData->pollData, 1);
          if (numPollDescriptors == 1)
          {
-            int pipes[2];
-            int pipeCreateResult = pipe(pipes);
-            if (pipeCreateResult == 0)
-            {
-               implData->pipeReadDescriptor = pipes[0];
-               implData->pipeWriteDescriptor = pipes[1];
-            }
+            implData->polling = implData->poller.add(implData->pollData.fd, Poller::Readable, implData.get());
          }
       }
 
-      if (implData->pipeReadDescriptor == -1 || implData->pipeWriteDescriptor == -1)
+      if (!implData->polling)
       {
          disconnect();
       }
       else
       {
-         implData->readThread = std::thread([this]() { readThreadRun(*this, implData->midiInput, implData->pollData, implData->pipeReadDescriptor, implData->shuttingDown); });
+         implData->parser.reset();
+
+#if MIDI_TIMESTAMPS
+         implData->timestamped = enableTimestamps(implData->midiInput);
+#endif
       }
 
       return isConnected();
@@ -113,29 +215,10 @@ namespace Kontroller
 
    void Device::Communicator::disconnect()
    {
-      implData->shuttingDown.store(true);
-
-      if (implData->pipeWriteDescriptor != -1)
+      if (implData->polling)
       {
-         write(implData->pipeWriteDescriptor, "wakey wakey", 1);
-      }
-
-      if (implData->readThread.joinable())
-      {
-         implData->readThread.join();
-      }
-
-      implData->shuttingDown.store(false);
-
-      if (implData->pipeWriteDescriptor != -1)
-      {
-         close(implData->pipeWriteDescriptor);
-         implData->pipeWriteDescriptor = -1;
-      }
-      if (implData->pipeReadDescriptor != -1)
-      {
-         close(implData->pipeReadDescriptor);
-         implData->pipeReadDescriptor = -1;
+         implData->poller.remove(implData->pollData.fd);
+         implData->polling = false;
       }
 
       if (implData->midiInput)
@@ -150,6 +233,7 @@ namespace Kontroller
       }
 
       implData->pollData = {};
+      implData->timestamped = false;
    }
 
    void Device::Communicator::poll()
@@ -157,6 +241,132 @@ namespace Kontroller
       checkForLostConnection();
    }
 
+   void Device::Communicator::waitForInput(std::chrono::milliseconds timeout)
+   {
+      // Lost connections are noticed through the descriptor, and new devices through the watcher, so there is no need to wake up periodically unless something was just plugged in (or /dev/snd isn't being watched)
+      int timeoutMS = static_cast<int>(timeout.count());
+      if (!isConnected() && implData->watchDescriptor != -1)
+      {
+         std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+         if (implData->devicesChanged)
+         {
+            timeoutMS = 0;
+         }
+         else if (now < implData->settleDeadline)
+         {
+            timeoutMS = static_cast<int>(kPlugRetryInterval.count());
+         }
+         else if (implData->soundWatch != -1)
+         {
+            timeoutMS = -1;
+         }
+      }
+
+      std::array<Poller::Event, kMaxPollEvents> events;
+      int numEvents = implData->poller.wait(events.data(), static_cast<int>(events.size()), timeoutMS);
+
+      // Taken as soon as the data is known to be available, so that it reflects when the device sent it rather than when it was processed (unless the kernel provides a better one)
+      std::chrono::steady_clock::time_point timestamp = std::chrono::steady_clock::now();
+
+      auto parseInput = [this](std::size_t numBytes, std::chrono::steady_clock::time_point arrivalTime)
+      {
+         implData->parser.parse(implData->readBuffer.data(), numBytes, [this, arrivalTime](uint8_t status, uint8_t id, uint8_t value)
+         {
+            if (status == kControlCommand)
+            {
+               onMessageReceived(id, value, arrivalTime);
+            }
+         });
+      };
+
+      for (int i = 0; i < numEvents; ++i)
+      {
+         if (events[i].userData == &implData->watchDescriptor)
+         {
+            bool changed = false;
+            alignas(inotify_event) std::array<char, 4096> watchEvents;
+            ssize_t numBytes = 0;
+            while ((numBytes = read(implData->watchDescriptor, watchEvents.data(), watchEvents.size())) > 0)
+            {
+               ssize_t offset = 0;
+               while (offset < numBytes)
+               {
+                  const inotify_event* watchEvent = reinterpret_cast<const inotify_event*>(watchEvents.data() + offset);
+                  offset += sizeof(inotify_event) + watchEvent->len;
+
+                  if (watchEvent->wd == implData->soundWatch)
+                  {
+                     if ((watchEvent->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) != 0)
+                     {
+                        // /dev/snd is gone (or was moved, in which case its watch is still there), watch for it to come back
+                        inotify_rm_watch(implData->watchDescriptor, implData->soundWatch);
+                        implData->soundWatch = -1;
+                     }
+                     changed = true;
+                  }
+                  else if (watchEvent->wd == implData->devWatch && watchEvent->len > 0 && std::strcmp(watchEvent->name, kSoundDirectoryName) == 0)
+                  {
+                     changed = true;
+                  }
+               }
+            }
+
+            // Any devices that were added along with /dev/snd are picked up by the probe that follows
+            if (updateWatches(implData->watchDescriptor, implData->soundWatch, implData->devWatch))
+            {
+               changed = true;
+            }
+
+            if (changed)
+            {
+               implData->devicesChanged = true;
+               implData->settleDeadline = timestamp + kPlugSettleTime;
+            }
+            continue;
+         }
+
+         // The wakeup notifier is cleared by the device
+         if (events[i].userData != implData.get() || !implData->polling)
+         {
+            continue;
+         }
+
+         ssize_t bytesRead = -EAGAIN;
+         if ((events[i].flags & Poller::Readable) != 0)
+         {
+#if MIDI_TIMESTAMPS
+            if (implData->timestamped)
+            {
+               // Each read only returns bytes that arrived together (along with when that was), so keep reading until everything available has been parsed
+               timespec arrivalTime = {};
+               while ((bytesRead = snd_rawmidi_tread(implData->midiInput, &arrivalTime, implData->readBuffer.data(), implData->readBuffer.size())) > 0)
+               {
+                  bool hasArrivalTime = arrivalTime.tv_sec != 0 || arrivalTime.tv_nsec != 0;
+                  parseInput(static_cast<std::size_t>(bytesRead), hasArrivalTime ? toTimePoint(arrivalTime) : timestamp);
+               }
+            }
+            else
+#endif
+            {
+               bytesRead = snd_rawmidi_read(implData->midiInput, implData->readBuffer.data(), implData->readBuffer.size());
+               if (bytesRead > 0)
+               {
+                  parseInput(static_cast<std::size_t>(bytesRead), timestamp);
+               }
+            }
+         }
+
+         if ((bytesRead < 0 && bytesRead != -EAGAIN) || (events[i].flags & Poller::Closed) != 0)
+         {
+            // Disconnect right away (rather than waiting for the next poll()), since the descriptor would otherwise keep waking us up
+            disconnect();
+
+            // Try once more, in case the device is still there (if it was unplugged, the next attempt waits until it comes back)
+            implData->devicesChanged = true;
+         }
+      }
+   }
+
    bool Device::Communicator::initializeMessage()
    {
       return true;
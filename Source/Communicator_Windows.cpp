@@ -28,7 +28,7 @@ namespace Kontroller
             std::array<uint8_t, 3> values = decode(dwParam1);
             if (values[0] == kControlCommand)
             {
-               communicator->onMessageReceived(values[1], values[2]);
+               communicator->onMessageReceived(values[1], values[2], std::chrono::steady_clock::now());
             }
          }
          else if (wMsg == MIM_CLOSE)
@@ -183,6 +183,14 @@ namespace Kontroller
       checkForLostConnection();
    }
 
+   // static
+   const bool Device::Communicator::kReadsOnDeviceThread = false;
+
+   void Device::Communicator::waitForInput(std::chrono::milliseconds)
+   {
+      // midiInputCallback() is called on a thread managed by Windows, so the device's thread never waits here
+   }
+
    bool Device::Communicator::initializeMessage()
    {
       return true;
@@ -43,12 +43,14 @@ namespace Kontroller
       {
          Device::Communicator* communicator = reinterpret_cast<Device::Communicator*>(readProcRefCon);
 
+         std::chrono::steady_clock::time_point timestamp = std::chrono::steady_clock::now();
+
          const MIDIPacket* packet = &pktlist->packet[0];
          for (UInt32 i = 0; i < pktlist->numPackets; ++i)
          {
             if (packet->length == 3 && packet->data[0] == kControlCommand)
             {
-               communicator->onMessageReceived(packet->data[1], packet->data[2]);
+               communicator->onMessageReceived(packet->data[1], packet->data[2], timestamp);
             }
 
             packet = MIDIPacketNext(packet);
@@ -205,6 +207,14 @@ namespace Kontroller
       checkForLostConnection();
    }
 
+   // static
+   const bool Device::Communicator::kReadsOnDeviceThread = false;
+
+   void Device::Communicator::waitForInput(std::chrono::milliseconds)
+   {
+      // CoreMIDI calls midiInputCallback() on a thread of its own, so the device's thread never waits here
+   }
+
    bool Device::Communicator::initializeMessage()
    {
       implData->lastPacket = MIDIPacketListInit(&implData->list);
@@ -1,5 +1,7 @@
 #include "Kontroller/Device.h"
 #include "Communicator.h"
+#include "Notifier.h"
+#include "StateLock.h"
 
 #include <chrono>
 
@@ -109,6 +111,8 @@ namespace Kontroller
 
       const std::size_t kLEDModeOffset = 16;
 
+      const std::chrono::milliseconds kWaitTimeout(1000);
+
       ControlID idForLED(LED led)
       {
          switch (led)
@@ -252,7 +256,14 @@ namespace Kontroller
          return success;
       }
 
-      bool processLEDCommand(Device::Communicator& communicator, LED led, bool enable)
+      // What the device's LEDs are showing, as far as we know (only used by the device's thread)
+      struct LEDShadow
+      {
+         uint32_t on = 0;
+         uint32_t known = 0;
+      };
+
+      bool processLEDCommand(Device::Communicator& communicator, LED led, bool enable, LEDShadow& shadow)
       {
          std::array<uint8_t, 3> sendData;
          sendData[0] = kControlCommand;
@@ -263,36 +274,105 @@ namespace Kontroller
          success = success && communicator.appendToMessage(sendData);
          success = success && communicator.finalizeMessage();
 
+         if (success)
+         {
+            uint32_t mask = getLEDMask(led);
+            shadow.on = enable ? (shadow.on | mask) : (shadow.on & ~mask);
+            shadow.known |= mask;
+         }
+
+         return success;
+      }
+
+      bool processLEDsCommand(Device::Communicator& communicator, uint32_t ledMask, LEDShadow& shadow)
+      {
+         uint32_t changed = ((ledMask ^ shadow.on) | ~shadow.known) & kAllLEDs;
+         if (changed == 0)
+         {
+            return true;
+         }
+
+         std::array<uint8_t, kNumLEDs * 3> sendData;
+         std::size_t numBytes = 0;
+         for (std::size_t i = 0; i < kNumLEDs; ++i)
+         {
+            LED led = static_cast<LED>(i + 1);
+            uint32_t mask = getLEDMask(led);
+            if ((changed & mask) != 0)
+            {
+               sendData[numBytes++] = kControlCommand;
+               sendData[numBytes++] = static_cast<uint8_t>(idForLED(led));
+               sendData[numBytes++] = (ledMask & mask) != 0 ? 0x7F : 0x00;
+            }
+         }
+
+         bool success = communicator.initializeMessage();
+         success = success && communicator.appendToMessage(sendData.data(), numBytes);
+         success = success && communicator.finalizeMessage();
+
+         if (success)
+         {
+            shadow.on = ledMask & kAllLEDs;
+            shadow.known = kAllLEDs;
+         }
+
          return success;
       }
    }
 
-   Device::Device()
-      : thread([this]{ threadRun(); })
+   Device::Device(std::size_t eventQueueCapacity /*= 0*/)
+      : stateLock(std::make_unique<StateLock>())
+      , eventQueue(eventQueueCapacity > 0 ? std::make_unique<moodycamel::ReaderWriterQueue<Event>>(eventQueueCapacity) : nullptr)
+      , notifier(std::make_unique<Notifier>())
+      , wakeNotifier(Communicator::kReadsOnDeviceThread ? std::make_unique<Notifier>() : nullptr)
+      , thread([this]{ threadRun(); })
    {
    }
 
    Device::~Device()
    {
-      {
-         std::lock_guard<std::mutex> lock(eventMutex);
-         shuttingDown.store(true);
-      }
-      cv.notify_all();
+      shuttingDown.store(true);
+      wakeThread();
 
       thread.join();
    }
 
-   State Device::getState() const
+   State Device::getState(uint64_t* version /*= nullptr*/) const
    {
-      std::lock_guard<std::mutex> lock(stateMutex);
+      State state;
+      uint64_t readVersion = stateLock->read(state);
+      if (version)
+      {
+         *version = readVersion;
+      }
+
       return state;
    }
 
+   uint64_t Device::getStateVersion() const
+   {
+      return stateLock->getVersion();
+   }
+
+   std::optional<StateChange> Device::waitForChange(uint64_t lastVersion, std::chrono::milliseconds timeout) const
+   {
+      if (!stateLock->waitForChange(lastVersion, timeout))
+      {
+         return std::nullopt;
+      }
+
+      // Read before the change mask, so that the mask covers everything in the state (and possibly a little more)
+      StateChange change;
+      change.version = stateLock->read(change.state);
+      change.changedControls = stateLock->getChangedControls(lastVersion);
+
+      return change;
+   }
+
    void Device::setState(const State& newState)
    {
-      std::lock_guard<std::mutex> lock(stateMutex);
-      state = newState;
+      std::lock_guard<std::mutex> lock(stateWriteMutex);
+      stateLock->set(newState);
    }
 
    void Device::enableLEDControl(bool enable)
@@ -302,12 +382,7 @@ namespace Kontroller
       command.value = enable;
 
       commandQueue.enqueue(command);
-
-      {
-         std::lock_guard<std::mutex> lock(eventMutex);
-         eventPending.store(true);
-      }
-      cv.notify_all();
+      wakeThread();
    }
 
    void Device::setLEDOn(LED led, bool on)
@@ -318,12 +393,17 @@ namespace Kontroller
       command.value = on;
 
       commandQueue.enqueue(command);
+      wakeThread();
+   }
 
-      {
-         std::lock_guard<std::mutex> lock(eventMutex);
-         eventPending.store(true);
-      }
-      cv.notify_all();
+   void Device::setLEDs(uint32_t ledMask)
+   {
+      MidiCommand command;
+      command.type = MidiCommand::Type::LEDs;
+      command.ledMask = ledMask;
+
+      commandQueue.enqueue(command);
+      wakeThread();
    }
 
    void Device::setButtonCallback(ButtonCallback callback)
@@ -359,16 +439,67 @@ namespace Kontroller
       setSliderCallback({});
    }
 
+   void Device::setEventCallback(EventCallback callback)
+   {
+      std::lock_guard<std::recursive_mutex> lock(callbackMutex);
+      eventCallback = std::move(callback);
+   }
+
+   void Device::clearEventCallback()
+   {
+      setEventCallback({});
+   }
+
+   NotificationHandle Device::getNotificationHandle() const
+   {
+      return notifier->getHandle();
+   }
+
+   void Device::clearNotification()
+   {
+      notifier->clear();
+   }
+
+   std::size_t Device::pollEvents(Event* events, std::size_t maxEvents)
+   {
+      std::size_t numEvents = 0;
+      while (eventQueue && numEvents < maxEvents && eventQueue->try_dequeue(events[numEvents]))
+      {
+         ++numEvents;
+      }
+
+      return numEvents;
+   }
+
    // static
    const char* const Device::kDeviceName = "nanoKONTROL2";
 
-   void Device::queueMessage(uint8_t id, uint8_t value)
+   void Device::receiveMessage(uint8_t id, uint8_t value, std::chrono::steady_clock::time_point timestamp)
    {
       MidiMessage message;
       message.id = id;
       message.value = value;
+      message.sequence = nextMessageSequence++;
+      message.timestamp = timestamp;
+
+      if (Communicator::kReadsOnDeviceThread)
+      {
+         // Already on the device's thread, so there is nothing to hand over
+         processMessage(message);
+         return;
+      }
 
       messageQueue.enqueue(message);
+      wakeThread();
+   }
+
+   void Device::wakeThread()
+   {
+      if (wakeNotifier)
+      {
+         wakeNotifier->notify();
+         return;
+      }
 
       {
          std::lock_guard<std::mutex> lock(eventMutex);
@@ -380,16 +511,24 @@ namespace Kontroller
    void Device::threadRun()
    {
       Communicator communicator(*this);
+      LEDShadow ledShadow;
       bool wasConnected = false;
       auto lastPollTime = std::chrono::steady_clock::now();
 
       bool shouldExit = false;
       while (!shouldExit)
       {
+         // Wait until there's something to do (with a timeout for handling (dis)connection)
+         if (Communicator::kReadsOnDeviceThread)
+         {
+            // Input is read and processed while waiting, commands and shutdown wake us up through the notifier
+            communicator.waitForInput(kWaitTimeout);
+            wakeNotifier->clear();
+         }
+         else
          {
-            // Wait until there's something to do (with a timeout for handling (dis)connection)
             std::unique_lock<std::mutex> lock(eventMutex);
-            cv.wait_for(lock, std::chrono::milliseconds(1000), [this]
+            cv.wait_for(lock, kWaitTimeout, [this]
             {
                return shuttingDown.load() || eventPending.load();
             });
@@ -426,6 +565,9 @@ namespace Kontroller
          if (isConnected != wasConnected)
          {
             communicatorConnected.store(isConnected);
+
+            // A (re)connected device may be showing anything
+            ledShadow = {};
          }
          wasConnected = isConnected;
 
@@ -440,10 +582,25 @@ namespace Kontroller
                {
                case MidiCommand::Type::Control:
                   success = processControlCommand(communicator, command.value);
+
+                  // Switching modes may change what the LEDs are showing
+                  ledShadow = {};
                   break;
                case MidiCommand::Type::LED:
-                  success = processLEDCommand(communicator, command.led, command.value);
+                  success = processLEDCommand(communicator, command.led, command.value, ledShadow);
                   break;
+               case MidiCommand::Type::LEDs:
+               {
+                  // Only the latest frame matters, so skip any that have already been replaced
+                  MidiCommand* nextCommand = nullptr;
+                  while ((nextCommand = commandQueue.peek()) != nullptr && nextCommand->type == MidiCommand::Type::LEDs)
+                  {
+                     commandQueue.try_dequeue(command);
+                  }
+
+                  success = processLEDsCommand(communicator, command.ledMask, ledShadow);
+                  break;
+               }
                default:
                   break;
                }
@@ -465,26 +622,48 @@ namespace Kontroller
       Dial dial = dialById(message.id);
       Slider slider = sliderById(message.id);
 
+      // Not a control that the device is known to have
+      if (button == Button::None && dial == Dial::None && slider == Slider::None)
+      {
+         return;
+      }
+
       bool boolValue = message.value != 0;
       float floatValue = message.value / 127.0f;
 
       {
-         std::lock_guard<std::mutex> lock(stateMutex);
+         std::lock_guard<std::mutex> lock(stateWriteMutex);
 
-         if (bool* buttonPointer = state.getButtonPointer(button))
+         if (button != Button::None)
          {
-            *buttonPointer = boolValue;
+            stateLock->set(button, boolValue);
          }
-         else if (float* dialPointer = state.getDialPointer(dial))
+         else if (dial != Dial::None)
          {
-            *dialPointer = floatValue;
+            stateLock->set(dial, floatValue);
          }
-         else if (float* sliderPointer = state.getSliderPointer(slider))
+         else if (slider != Slider::None)
          {
-            *sliderPointer = floatValue;
+            stateLock->set(slider, floatValue);
          }
       }
 
+      Event event;
+      event.button = button;
+      event.dial = dial;
+      event.slider = slider;
+      event.pressed = button != Button::None && boolValue;
+      event.value = button == Button::None ? floatValue : 0.0f;
+      event.sequence = message.sequence;
+      event.timestamp = message.timestamp;
+
+      // The queue is bounded (and never allocates), so events that don't fit are dropped rather than waiting for the reader
+      if (eventQueue && !eventQueue->try_enqueue(event))
+      {
+         ++numDroppedEvents;
+      }
+      notifier->notify();
+
       {
          std::lock_guard<std::recursive_mutex> lock(callbackMutex);
 
@@ -500,6 +679,11 @@ namespace Kontroller
          {
             sliderCallback(slider, floatValue);
          }
+
+         if (eventCallback)
+         {
+            eventCallback(event);
+         }
       }
    }
 }
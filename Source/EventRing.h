@@ -0,0 +1,151 @@
+#pragma once
+
+#include "Kontroller/Packet.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace Kontroller
+{
+   // An event along with its place in the stream, and when its data was read from the device (nanoseconds since the steady clock's epoch)
+   struct SequencedEvent
+   {
+      uint64_t sequence = 0;
+      uint64_t timestamp = 0;
+      EventPacket packet;
+   };
+
+   inline uint64_t toTimestamp(std::chrono::steady_clock::time_point timePoint)
+   {
+      return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(timePoint.time_since_epoch()).count());
+   }
+
+   inline std::chrono::steady_clock::time_point fromTimestamp(uint64_t timestamp)
+   {
+      return std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(timestamp)));
+   }
+
+   // Single producer / multiple consumer broadcast ring of sequenced events
+   // Every consumer keeps its own cursor (the sequence number of the next event it wants), so publishing an event costs the same no matter how many consumers there are
+   // Slots are stamped with the sequence number of the event they hold, which lets a consumer that has been lapped by the producer detect that it missed events
+   template<std::size_t Capacity>
+   class EventRing
+   {
+   public:
+      static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+      // Sequence numbers start at 1, so that 0 can be used to mean "nothing"
+      static constexpr uint64_t kFirstSequence = 1;
+
+      enum class ReadResult
+      {
+         Success,
+         Empty,
+         Overrun
+      };
+
+      using Entry = SequencedEvent;
+
+      static constexpr std::size_t getCapacity()
+      {
+         return Capacity;
+      }
+
+      // Sequence number that will be assigned to the next published event
+      uint64_t getNextSequence() const
+      {
+         return nextSequence.load(std::memory_order_acquire);
+      }
+
+      // Oldest sequence number that can still be read
+      uint64_t getOldestSequence() const
+      {
+         uint64_t next = getNextSequence();
+         return next > Capacity + kFirstSequence ? next - Capacity : kFirstSequence;
+      }
+
+      // Must only be called from the (single) producer thread, returns the sequence number assigned to the event
+      uint64_t publish(const EventPacket& packet, uint64_t timestamp = 0)
+      {
+         uint64_t sequence = nextSequence.load(std::memory_order_relaxed);
+         Slot& slot = slots[sequence & kMask];
+
+         // Mark the slot as being written first, so that readers racing with us can tell their copy is torn
+         slot.sequence.store(kWriting, std::memory_order_relaxed);
+         std::atomic_thread_fence(std::memory_order_release);
+
+         slot.data.store(pack(packet), std::memory_order_relaxed);
+         slot.timestamp.store(timestamp, std::memory_order_relaxed);
+         slot.sequence.store(sequence, std::memory_order_release);
+
+         nextSequence.store(sequence + 1, std::memory_order_release);
+
+         return sequence;
+      }
+
+      ReadResult read(uint64_t sequence, Entry& entry) const
+      {
+         if (sequence >= getNextSequence())
+         {
+            return ReadResult::Empty;
+         }
+
+         if (sequence < kFirstSequence)
+         {
+            return ReadResult::Overrun;
+         }
+
+         const Slot& slot = slots[sequence & kMask];
+         if (slot.sequence.load(std::memory_order_acquire) != sequence)
+         {
+            return ReadResult::Overrun;
+         }
+
+         uint64_t data = slot.data.load(std::memory_order_relaxed);
+         uint64_t timestamp = slot.timestamp.load(std::memory_order_relaxed);
+
+         std::atomic_thread_fence(std::memory_order_acquire);
+         if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+         {
+            return ReadResult::Overrun;
+         }
+
+         entry.sequence = sequence;
+         entry.timestamp = timestamp;
+         entry.packet = unpack(data);
+         return ReadResult::Success;
+      }
+
+   private:
+      static constexpr std::size_t kMask = Capacity - 1;
+      static constexpr uint64_t kWriting = ~0ull;
+
+      struct Slot
+      {
+         std::atomic<uint64_t> sequence = { 0 };
+         std::atomic<uint64_t> data = { 0 };
+         std::atomic<uint64_t> timestamp = { 0 };
+      };
+
+      static uint64_t pack(const EventPacket& packet)
+      {
+         return (static_cast<uint64_t>(packet.type) << 48) | (static_cast<uint64_t>(packet.id) << 32) | packet.value;
+      }
+
+      static EventPacket unpack(uint64_t data)
+      {
+         EventPacket packet;
+         packet.type = static_cast<uint16_t>(data >> 48);
+         packet.id = static_cast<uint16_t>(data >> 32);
+         packet.value = static_cast<uint32_t>(data);
+
+         return packet;
+      }
+
+      alignas(64) std::atomic<uint64_t> nextSequence = { kFirstSequence };
+      alignas(64) std::array<Slot, Capacity> slots;
+   };
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Kontroller
+{
+   // Incremental parser for a raw MIDI byte stream, which can be fed whatever a read returned (including partial messages)
+   // Handles running status and realtime bytes interleaved with other messages, and skips system exclusive / common messages
+   class MidiParser
+   {
+   public:
+      // Calls onMessage(status, data1, data2) for every complete channel message (data2 is 0 for messages with a single data byte)
+      template<typename Callback>
+      void parse(const uint8_t* data, std::size_t numBytes, Callback&& onMessage)
+      {
+         for (std::size_t i = 0; i < numBytes; ++i)
+         {
+            uint8_t byte = data[i];
+
+            if (byte >= kFirstRealtimeStatus)
+            {
+               // Realtime messages can appear anywhere (even in the middle of another message), and don't affect running status
+               continue;
+            }
+
+            if ((byte & kStatusBit) != 0)
+            {
+               onStatus(byte);
+               continue;
+            }
+
+            if (inSystemMessage)
+            {
+               // System exclusive / common data, which we don't use
+               continue;
+            }
+
+            if (status == 0)
+            {
+               // Data without a status (e.g. when joining a stream part way through a message)
+               continue;
+            }
+
+            dataBytes[numDataBytes++] = byte;
+            if (numDataBytes == getNumDataBytes(status))
+            {
+               onMessage(status, dataBytes[0], numDataBytes > 1 ? dataBytes[1] : static_cast<uint8_t>(0));
+
+               // Running status: further data bytes start a new message with the same status
+               numDataBytes = 0;
+            }
+         }
+      }
+
+      void reset()
+      {
+         status = 0;
+         numDataBytes = 0;
+         inSystemMessage = false;
+      }
+
+   private:
+      static constexpr uint8_t kStatusBit = 0x80;
+      static constexpr uint8_t kFirstSystemStatus = 0xF0;
+      static constexpr uint8_t kFirstRealtimeStatus = 0xF8;
+
+      static std::size_t getNumDataBytes(uint8_t channelStatus)
+      {
+         switch (channelStatus & 0xF0)
+         {
+         case 0xC0: // Program change
+         case 0xD0: // Channel pressure
+            return 1;
+         default:
+            return 2;
+         }
+      }
+
+      void onStatus(uint8_t byte)
+      {
+         numDataBytes = 0;
+
+         if (byte >= kFirstSystemStatus)
+         {
+            // System exclusive and system common messages cancel running status (and end any system exclusive message in progress)
+            status = 0;
+            inSystemMessage = true;
+         }
+         else
+         {
+            status = byte;
+            inSystemMessage = false;
+         }
+      }
+
+      uint8_t status = 0;
+      uint8_t dataBytes[2] = {};
+      std::size_t numDataBytes = 0;
+      bool inSystemMessage = false;
+   };
+}
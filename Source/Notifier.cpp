@@ -0,0 +1,144 @@
+#include "Notifier.h"
+
+#include <cstdint>
+
+#if defined(_WIN32)
+#  define NOTIFIER_WINDOWS 1
+#  define NOTIFIER_EVENTFD 0
+#  define NOTIFIER_PIPE 0
+#elif defined(__linux__)
+#  define NOTIFIER_WINDOWS 0
+#  define NOTIFIER_EVENTFD 1
+#  define NOTIFIER_PIPE 0
+#else
+#  define NOTIFIER_WINDOWS 0
+#  define NOTIFIER_EVENTFD 0
+#  define NOTIFIER_PIPE 1
+#endif
+
+#if NOTIFIER_WINDOWS
+#  include <Windows.h>
+#else
+#  include <fcntl.h>
+#  include <unistd.h>
+#  if NOTIFIER_EVENTFD
+#     include <sys/eventfd.h>
+#  endif
+#endif
+
+namespace Kontroller
+{
+#if NOTIFIER_WINDOWS
+   struct Notifier::ImplData
+   {
+      HANDLE event = nullptr;
+   };
+
+   Notifier::Notifier()
+      : implData(std::make_unique<ImplData>())
+   {
+      // Manual reset, so that it stays signaled until cleared
+      implData->event = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+   }
+
+   Notifier::~Notifier()
+   {
+      if (implData->event)
+      {
+         CloseHandle(implData->event);
+      }
+   }
+
+   NotificationHandle Notifier::getHandle() const
+   {
+      return implData->event;
+   }
+
+   void Notifier::notify()
+   {
+      if (implData->event && !pending.exchange(true))
+      {
+         SetEvent(implData->event);
+      }
+   }
+
+   void Notifier::clear()
+   {
+      if (implData->event)
+      {
+         ResetEvent(implData->event);
+         pending.store(false);
+      }
+   }
+#else
+   struct Notifier::ImplData
+   {
+      int readDescriptor = -1;
+      int writeDescriptor = -1;
+   };
+
+   Notifier::Notifier()
+      : implData(std::make_unique<ImplData>())
+   {
+#  if NOTIFIER_EVENTFD
+      // A single descriptor is both ends
+      implData->readDescriptor = implData->writeDescriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#  else
+      int pipes[2];
+      if (pipe(pipes) == 0)
+      {
+         for (int descriptor : pipes)
+         {
+            fcntl(descriptor, F_SETFL, fcntl(descriptor, F_GETFL) | O_NONBLOCK);
+            fcntl(descriptor, F_SETFD, FD_CLOEXEC);
+         }
+
+         implData->readDescriptor = pipes[0];
+         implData->writeDescriptor = pipes[1];
+      }
+#  endif
+   }
+
+   Notifier::~Notifier()
+   {
+      if (implData->writeDescriptor != -1 && implData->writeDescriptor != implData->readDescriptor)
+      {
+         close(implData->writeDescriptor);
+      }
+      if (implData->readDescriptor != -1)
+      {
+         close(implData->readDescriptor);
+      }
+   }
+
+   NotificationHandle Notifier::getHandle() const
+   {
+      return implData->readDescriptor;
+   }
+
+   void Notifier::notify()
+   {
+      if (implData->writeDescriptor != -1 && !pending.exchange(true))
+      {
+         uint64_t value = 1;
+         ssize_t result = write(implData->writeDescriptor, &value, sizeof(value));
+         (void)result;
+      }
+   }
+
+   void Notifier::clear()
+   {
+      if (implData->readDescriptor == -1)
+      {
+         return;
+      }
+
+      // The flag is only reset once the descriptor has been drained, so a notify() in between is lost (which is fine, since the waiting thread reads whatever it was about after this)
+      uint64_t value = 0;
+      while (read(implData->readDescriptor, &value, sizeof(value)) > 0)
+      {
+      }
+      pending.store(false);
+   }
+#endif
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "Kontroller/Notification.h"
+
+#include <atomic>
+#include <memory>
+
+namespace Kontroller
+{
+   // Wakes up an event loop on another thread, through a handle that it can wait on along with its own
+   class Notifier
+   {
+   public:
+      struct ImplData;
+
+      Notifier();
+      ~Notifier();
+
+      Notifier(const Notifier& other) = delete;
+      Notifier& operator=(const Notifier& other) = delete;
+
+      bool isValid() const
+      {
+         return getHandle() != kInvalidNotificationHandle;
+      }
+
+      NotificationHandle getHandle() const;
+
+      // Makes the handle readable (signaled), further calls before the next clear() only cost an atomic exchange
+      void notify();
+
+      // Makes the handle unreadable again, anything that happened before it returns has to be picked up by the waiting thread afterwards (since it won't be notified again)
+      void clear();
+
+   private:
+      std::unique_ptr<ImplData> implData;
+      std::atomic_bool pending = { false };
+   };
+}
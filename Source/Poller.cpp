@@ -0,0 +1,407 @@
+#include "Poller.h"
+
+#if defined(__linux__)
+#  define POLLER_EPOLL 1
+#else
+#  define POLLER_EPOLL 0
+#endif
+
+#if POLLER_EPOLL
+#  include <sys/epoll.h>
+#  include <sys/eventfd.h>
+#elif SOCK_POSIX
+#  include <fcntl.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <vector>
+
+namespace Kontroller
+{
+   namespace
+   {
+      constexpr int kMaxEventsPerWait = 64;
+   }
+
+#if POLLER_EPOLL
+   namespace
+   {
+      uint32_t toEpollEvents(uint32_t flags)
+      {
+         uint32_t events = EPOLLRDHUP;
+         if (flags & Poller::Readable)
+         {
+            events |= EPOLLIN;
+         }
+         if (flags & Poller::Writable)
+         {
+            events |= EPOLLOUT;
+         }
+
+         return events;
+      }
+   }
+
+   struct Poller::ImplData
+   {
+      int epollDescriptor = -1;
+      int wakeDescriptor = -1;
+      std::atomic_bool wakePending = { false };
+   };
+
+   Poller::Poller()
+      : implData(std::make_unique<ImplData>())
+   {
+      implData->epollDescriptor = epoll_create1(EPOLL_CLOEXEC);
+      implData->wakeDescriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+      if (implData->epollDescriptor != -1 && implData->wakeDescriptor != -1)
+      {
+         epoll_event event = {};
+         event.events = EPOLLIN;
+         event.data.ptr = implData.get();
+         epoll_ctl(implData->epollDescriptor, EPOLL_CTL_ADD, implData->wakeDescriptor, &event);
+      }
+   }
+
+   Poller::~Poller()
+   {
+      if (implData->wakeDescriptor != -1)
+      {
+         close(implData->wakeDescriptor);
+      }
+      if (implData->epollDescriptor != -1)
+      {
+         close(implData->epollDescriptor);
+      }
+   }
+
+   bool Poller::isValid() const
+   {
+      return implData->epollDescriptor != -1 && implData->wakeDescriptor != -1;
+   }
+
+   bool Poller::add(Sock::Socket socket, uint32_t flags, void* userData)
+   {
+      epoll_event event = {};
+      event.events = toEpollEvents(flags);
+      event.data.ptr = userData;
+
+      return epoll_ctl(implData->epollDescriptor, EPOLL_CTL_ADD, socket, &event) == 0;
+   }
+
+   bool Poller::modify(Sock::Socket socket, uint32_t flags, void* userData)
+   {
+      epoll_event event = {};
+      event.events = toEpollEvents(flags);
+      event.data.ptr = userData;
+
+      return epoll_ctl(implData->epollDescriptor, EPOLL_CTL_MOD, socket, &event) == 0;
+   }
+
+   bool Poller::remove(Sock::Socket socket)
+   {
+      epoll_event event = {};
+      return epoll_ctl(implData->epollDescriptor, EPOLL_CTL_DEL, socket, &event) == 0;
+   }
+
+   int Poller::wait(Event* events, int maxEvents, int timeoutMS)
+   {
+      std::array<epoll_event, kMaxEventsPerWait> epollEvents;
+      int numReady = epoll_wait(implData->epollDescriptor, epollEvents.data(), std::min(maxEvents, kMaxEventsPerWait), timeoutMS);
+      if (numReady < 0)
+      {
+         return Sock::System::getLastError() == EINTR ? 0 : -1;
+      }
+
+      int numEvents = 0;
+      for (int i = 0; i < numReady; ++i)
+      {
+         const epoll_event& epollEvent = epollEvents[i];
+         if (epollEvent.data.ptr == implData.get())
+         {
+            // Clear the pending flag before draining, so that any wake() that races with us results in another wakeup
+            implData->wakePending.store(false);
+
+            eventfd_t value = 0;
+            eventfd_read(implData->wakeDescriptor, &value);
+            continue;
+         }
+
+         Event& event = events[numEvents++];
+         event.userData = epollEvent.data.ptr;
+         event.flags = 0;
+         // The peer closing its end only means that reads stop once everything it sent before that has been read (which is how it's noticed elsewhere)
+         if (epollEvent.events & (EPOLLIN | EPOLLRDHUP))
+         {
+            event.flags |= Readable;
+         }
+         if (epollEvent.events & EPOLLOUT)
+         {
+            event.flags |= Writable;
+         }
+         if (epollEvent.events & (EPOLLERR | EPOLLHUP))
+         {
+            event.flags |= Closed;
+         }
+      }
+
+      return numEvents;
+   }
+
+   void Poller::wake()
+   {
+      if (!implData->wakePending.exchange(true))
+      {
+         eventfd_write(implData->wakeDescriptor, 1);
+      }
+   }
+#else
+   namespace
+   {
+      short toPollEvents(uint32_t flags)
+      {
+         short events = 0;
+         if (flags & Poller::Readable)
+         {
+            events |= POLLRDNORM;
+         }
+         if (flags & Poller::Writable)
+         {
+            events |= POLLWRNORM;
+         }
+
+         return events;
+      }
+
+#if SOCK_WINDOWS
+      // There is no pipe that WSAPoll() can wait on, so wake up using a UDP socket connected to itself
+      bool createWakeSockets(Sock::Socket& readSocket, Sock::Socket& writeSocket)
+      {
+         Sock::Socket socket = Sock::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+         if (socket == Sock::kInvalidSocket)
+         {
+            return false;
+         }
+
+         sockaddr_in address = {};
+         address.sin_family = AF_INET;
+         address.sin_addr.s_addr = Sock::Endian::hostToNetworkLong(INADDR_LOOPBACK);
+         address.sin_port = 0;
+
+         socklen_t addressLength = sizeof(address);
+         unsigned long nonBlocking = 1;
+         if (Sock::bind(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == Sock::kSocketError
+            || Sock::getsockname(socket, reinterpret_cast<sockaddr*>(&address), &addressLength) == Sock::kSocketError
+            || Sock::connect(socket, reinterpret_cast<sockaddr*>(&address), addressLength) == Sock::kSocketError
+            || Sock::ioctl(socket, FIONBIO, &nonBlocking) == Sock::kSocketError)
+         {
+            Sock::close(socket);
+            return false;
+         }
+
+         readSocket = socket;
+         writeSocket = socket;
+         return true;
+      }
+
+      // Both ends are the same socket
+      void closeWakeSockets(Sock::Socket readSocket, Sock::Socket)
+      {
+         Sock::close(readSocket);
+      }
+#elif SOCK_POSIX
+      bool createWakeSockets(Sock::Socket& readSocket, Sock::Socket& writeSocket)
+      {
+         int pipes[2];
+         if (pipe(pipes) != 0)
+         {
+            return false;
+         }
+
+         for (int descriptor : pipes)
+         {
+            fcntl(descriptor, F_SETFL, fcntl(descriptor, F_GETFL) | O_NONBLOCK);
+            fcntl(descriptor, F_SETFD, FD_CLOEXEC);
+         }
+
+         readSocket = pipes[0];
+         writeSocket = pipes[1];
+         return true;
+      }
+
+      void closeWakeSockets(Sock::Socket readSocket, Sock::Socket writeSocket)
+      {
+         close(readSocket);
+         close(writeSocket);
+      }
+#endif
+
+      void writeWakeSocket(Sock::Socket writeSocket)
+      {
+         uint8_t value = 1;
+#if SOCK_WINDOWS
+         Sock::send(writeSocket, &value, sizeof(value), 0);
+#elif SOCK_POSIX
+         write(writeSocket, &value, sizeof(value));
+#endif
+      }
+
+      void drainWakeSocket(Sock::Socket readSocket)
+      {
+         std::array<uint8_t, 64> buffer;
+#if SOCK_WINDOWS
+         while (Sock::recv(readSocket, buffer.data(), static_cast<Sock::Length>(buffer.size()), 0) > 0);
+#elif SOCK_POSIX
+         while (read(readSocket, buffer.data(), buffer.size()) > 0);
+#endif
+      }
+   }
+
+   struct Poller::ImplData
+   {
+      // The first entry is always the wake socket
+      std::vector<pollfd> pollData;
+      std::vector<void*> userData;
+
+      Sock::Socket wakeReadSocket = Sock::kInvalidSocket;
+      Sock::Socket wakeWriteSocket = Sock::kInvalidSocket;
+      std::atomic_bool wakePending = { false };
+
+      std::size_t find(Sock::Socket socket) const
+      {
+         for (std::size_t i = 1; i < pollData.size(); ++i)
+         {
+            if (pollData[i].fd == socket)
+            {
+               return i;
+            }
+         }
+
+         return 0;
+      }
+   };
+
+   Poller::Poller()
+      : implData(std::make_unique<ImplData>())
+   {
+      if (createWakeSockets(implData->wakeReadSocket, implData->wakeWriteSocket))
+      {
+         pollfd wakePollData = {};
+         wakePollData.fd = implData->wakeReadSocket;
+         wakePollData.events = POLLRDNORM;
+
+         implData->pollData.push_back(wakePollData);
+         implData->userData.push_back(nullptr);
+      }
+   }
+
+   Poller::~Poller()
+   {
+      if (implData->wakeReadSocket != Sock::kInvalidSocket)
+      {
+         closeWakeSockets(implData->wakeReadSocket, implData->wakeWriteSocket);
+      }
+   }
+
+   bool Poller::isValid() const
+   {
+      return implData->wakeReadSocket != Sock::kInvalidSocket;
+   }
+
+   bool Poller::add(Sock::Socket socket, uint32_t flags, void* userData)
+   {
+      if (implData->find(socket) != 0)
+      {
+         return false;
+      }
+
+      pollfd socketPollData = {};
+      socketPollData.fd = socket;
+      socketPollData.events = toPollEvents(flags);
+
+      implData->pollData.push_back(socketPollData);
+      implData->userData.push_back(userData);
+      return true;
+   }
+
+   bool Poller::modify(Sock::Socket socket, uint32_t flags, void* userData)
+   {
+      std::size_t index = implData->find(socket);
+      if (index == 0)
+      {
+         return false;
+      }
+
+      implData->pollData[index].events = toPollEvents(flags);
+      implData->userData[index] = userData;
+      return true;
+   }
+
+   bool Poller::remove(Sock::Socket socket)
+   {
+      std::size_t index = implData->find(socket);
+      if (index == 0)
+      {
+         return false;
+      }
+
+      implData->pollData.erase(implData->pollData.begin() + index);
+      implData->userData.erase(implData->userData.begin() + index);
+      return true;
+   }
+
+   int Poller::wait(Event* events, int maxEvents, int timeoutMS)
+   {
+      int numReady = Sock::poll(implData->pollData.data(), static_cast<Sock::NumFileDescriptors>(implData->pollData.size()), timeoutMS);
+      if (numReady < 0)
+      {
+         return -1;
+      }
+
+      if (implData->pollData[0].revents != 0)
+      {
+         implData->wakePending.store(false);
+         drainWakeSocket(implData->wakeReadSocket);
+      }
+
+      int numEvents = 0;
+      for (std::size_t i = 1; i < implData->pollData.size() && numEvents < maxEvents; ++i)
+      {
+         const pollfd& socketPollData = implData->pollData[i];
+         if (socketPollData.revents == 0)
+         {
+            continue;
+         }
+
+         Event& event = events[numEvents++];
+         event.userData = implData->userData[i];
+         event.flags = 0;
+         if (socketPollData.revents & POLLRDNORM)
+         {
+            event.flags |= Readable;
+         }
+         if (socketPollData.revents & POLLWRNORM)
+         {
+            event.flags |= Writable;
+         }
+         if (socketPollData.revents & (POLLERR | POLLHUP | POLLNVAL))
+         {
+            event.flags |= Closed;
+         }
+      }
+
+      return numEvents;
+   }
+
+   void Poller::wake()
+   {
+      if (!implData->wakePending.exchange(true))
+      {
+         writeWakeSocket(implData->wakeWriteSocket);
+      }
+   }
+#endif
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Sock.h"
+
+#include <cstdint>
+#include <memory>
+
+namespace Kontroller
+{
+   // Readiness notification for a set of sockets (epoll on Linux, poll / WSAPoll elsewhere)
+   // Sockets may only be added / modified / removed from the thread that calls wait(), but wake() may be called from any thread
+   class Poller
+   {
+   public:
+      enum Flags : uint32_t
+      {
+         Readable = 1 << 0,
+         Writable = 1 << 1,
+
+         // An error, or the connection is gone in both directions (a peer that only stops sending is reported as Readable, and reads then return 0)
+         Closed = 1 << 2
+      };
+
+      struct Event
+      {
+         void* userData = nullptr;
+         uint32_t flags = 0;
+      };
+
+      struct ImplData;
+
+      Poller();
+      ~Poller();
+
+      Poller(const Poller& other) = delete;
+      Poller& operator=(const Poller& other) = delete;
+
+      bool isValid() const;
+
+      bool add(Sock::Socket socket, uint32_t flags, void* userData);
+      bool modify(Sock::Socket socket, uint32_t flags, void* userData);
+      bool remove(Sock::Socket socket);
+
+      // Returns the number of events written to the array (which may be zero if woken or timed out), or -1 on error
+      int wait(Event* events, int maxEvents, int timeoutMS);
+
+      // Causes the current (or next) call to wait() to return immediately
+      void wake();
+
+   private:
+      std::unique_ptr<ImplData> implData;
+   };
+}
@@ -0,0 +1,177 @@
+#include "Protocol.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace Kontroller
+{
+   namespace Protocol
+   {
+      std::optional<uint8_t> getControlIndex(const EventPacket& packet)
+      {
+         switch (packet.type)
+         {
+         case EventPacket::Button:
+            if (packet.id >= 1 && packet.id <= kNumButtons)
+            {
+               return static_cast<uint8_t>(packet.id - 1);
+            }
+            break;
+         case EventPacket::Dial:
+            if (packet.id >= 1 && packet.id <= kNumDials)
+            {
+               return static_cast<uint8_t>(kNumButtons + packet.id - 1);
+            }
+            break;
+         case EventPacket::Slider:
+            if (packet.id >= 1 && packet.id <= kNumSliders)
+            {
+               return static_cast<uint8_t>(kNumButtons + kNumDials + packet.id - 1);
+            }
+            break;
+         default:
+            break;
+         }
+
+         return std::nullopt;
+      }
+
+      uint8_t getRawValue(const EventPacket& packet)
+      {
+         if (packet.type == EventPacket::Button)
+         {
+            return packet.value != 0 ? 127 : 0;
+         }
+
+         float value = 0.0f;
+         static_assert(sizeof(value) == sizeof(packet.value), "Packet data size does not match event data size");
+         memcpy(&value, &packet.value, sizeof(value));
+
+         return static_cast<uint8_t>(std::lround(std::clamp(value, 0.0f, 1.0f) * 127.0f));
+      }
+
+      std::optional<EventPacket> makePacket(uint8_t controlIndex, uint8_t rawValue)
+      {
+         if (controlIndex >= kNumControls)
+         {
+            return std::nullopt;
+         }
+
+         EventPacket packet;
+         if (controlIndex < kNumButtons)
+         {
+            packet.type = EventPacket::Button;
+            packet.id = controlIndex + 1;
+            packet.value = rawValue != 0 ? 1 : 0;
+
+            return packet;
+         }
+
+         if (controlIndex < kNumButtons + kNumDials)
+         {
+            packet.type = EventPacket::Dial;
+            packet.id = static_cast<uint16_t>(controlIndex - kNumButtons + 1);
+         }
+         else
+         {
+            packet.type = EventPacket::Slider;
+            packet.id = static_cast<uint16_t>(controlIndex - kNumButtons - kNumDials + 1);
+         }
+
+         // Same conversion as the device uses
+         float value = (rawValue & 0x7F) / 127.0f;
+         memcpy(&packet.value, &value, sizeof(packet.value));
+
+         return packet;
+      }
+
+      std::size_t beginFrame(std::vector<uint8_t>& buffer, FrameType type)
+      {
+         std::size_t frameOffset = buffer.size();
+         buffer.push_back(static_cast<uint8_t>(type));
+         buffer.push_back(0);
+         buffer.push_back(0);
+
+         return frameOffset;
+      }
+
+      void endFrame(std::vector<uint8_t>& buffer, std::size_t frameOffset)
+      {
+         std::size_t payloadSize = std::min(buffer.size() - frameOffset - kFrameHeaderSize, kMaxFramePayloadSize);
+         buffer[frameOffset + 1] = static_cast<uint8_t>(payloadSize >> 8);
+         buffer[frameOffset + 2] = static_cast<uint8_t>(payloadSize);
+      }
+
+      void appendUint32(std::vector<uint8_t>& buffer, uint32_t value)
+      {
+         buffer.push_back(static_cast<uint8_t>(value >> 24));
+         buffer.push_back(static_cast<uint8_t>(value >> 16));
+         buffer.push_back(static_cast<uint8_t>(value >> 8));
+         buffer.push_back(static_cast<uint8_t>(value));
+      }
+
+      uint32_t readUint32(const uint8_t* data)
+      {
+         return (static_cast<uint32_t>(data[0]) << 24) | (static_cast<uint32_t>(data[1]) << 16) | (static_cast<uint32_t>(data[2]) << 8) | data[3];
+      }
+
+      void appendUint64(std::vector<uint8_t>& buffer, uint64_t value)
+      {
+         appendUint32(buffer, static_cast<uint32_t>(value >> 32));
+         appendUint32(buffer, static_cast<uint32_t>(value));
+      }
+
+      uint64_t readUint64(const uint8_t* data)
+      {
+         return (static_cast<uint64_t>(readUint32(data)) << 32) | readUint32(data + 4);
+      }
+
+      void appendVarint(std::vector<uint8_t>& buffer, int64_t value)
+      {
+         uint64_t zigzag = (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+         while (zigzag >= 0x80)
+         {
+            buffer.push_back(static_cast<uint8_t>(zigzag | 0x80));
+            zigzag >>= 7;
+         }
+         buffer.push_back(static_cast<uint8_t>(zigzag));
+      }
+
+      std::size_t readVarint(const uint8_t* data, std::size_t size, int64_t& value)
+      {
+         uint64_t zigzag = 0;
+         for (std::size_t i = 0; i < std::min(size, kMaxVarintSize); ++i)
+         {
+            zigzag |= static_cast<uint64_t>(data[i] & 0x7F) << (7 * i);
+            if ((data[i] & 0x80) == 0)
+            {
+               value = static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+               return i + 1;
+            }
+         }
+
+         return 0;
+      }
+
+      std::size_t parseFrame(const uint8_t* data, std::size_t size, Frame& frame)
+      {
+         if (size < kFrameHeaderSize)
+         {
+            return 0;
+         }
+
+         std::size_t payloadSize = (static_cast<std::size_t>(data[1]) << 8) | data[2];
+         if (size < kFrameHeaderSize + payloadSize)
+         {
+            return 0;
+         }
+
+         frame.type = static_cast<FrameType>(data[0]);
+         frame.payload = data + kFrameHeaderSize;
+         frame.payloadSize = payloadSize;
+
+         return kFrameHeaderSize + payloadSize;
+      }
+   }
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "Kontroller/Packet.h"
+#include "Kontroller/State.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace Kontroller
+{
+   // Version 1 of the protocol is just a stream of EventPackets (in network byte order) from the server, and clients never send anything
+   // Clients that support version 2 start by sending kMagic followed by a Hello frame. The server answers with a Welcome frame, after which everything is sent as frames
+   // Servers that don't receive a hello in time fall back to version 1, and clients can tell that they are talking to a version 1 server since its first byte is always zero
+   namespace Protocol
+   {
+      constexpr uint8_t kVersion = 2;
+      constexpr std::array<uint8_t, 4> kMagic = { 'K', 'N', 'K', '2' };
+
+      // Optional features, requested by the client in its hello and confirmed by the server in its welcome
+      enum Capability : uint32_t
+      {
+         // Events are sent as TimedEvents frames instead of Events frames
+         kCapabilityTimedEvents = 1u << 0,
+
+         // Both sides send Heartbeat frames when they have nothing else to send, and drop the connection when they hear nothing for the idle timeout
+         kCapabilityHeartbeats = 1u << 1,
+
+         // The server says which events the client has caught up to (in Sync frames), so that a reconnecting client can ask for just the events it missed
+         // Only accepted along with kCapabilityTimedEvents, since the client needs every event's sequence number
+         kCapabilityResume = 1u << 2
+      };
+
+      constexpr uint32_t kSupportedCapabilities = kCapabilityTimedEvents | kCapabilityHeartbeats | kCapabilityResume;
+
+      // Every frame starts with its type, followed by the size of its payload (16 bits, big endian)
+      constexpr std::size_t kFrameHeaderSize = 3;
+      constexpr std::size_t kMaxFramePayloadSize = 0xFFFF;
+
+      enum class FrameType : uint8_t
+      {
+         // Client to server: version (8 bits), capabilities (32 bits), then optionally a control mask to subscribe to (64 bits, everything if omitted)
+         // and the maximum number of updates per second that the client wants (16 bits, 0 or omitted for no limit)
+         // With kCapabilityResume, optionally followed by the epoch (64 bits) and sequence number (64 bits) from the last Sync frame or event the client received, to resume from
+         Hello = 0x01,
+
+         // Server to client: version (8 bits), capabilities (32 bits, the subset of the client's that the server supports)
+         // With kCapabilityHeartbeats, followed by the heartbeat interval and the idle timeout that both sides should use (16 bits each, in milliseconds)
+         Welcome = 0x02,
+
+         // Server to client: raw value of every control, in control index order
+         State = 0x03,
+
+         // Server to client: any number of compact events
+         Events = 0x04,
+
+         // Server to client: any number of compact events, each followed by its sequence number and timestamp (nanoseconds on the server's steady clock)
+         // Both are encoded as zigzag varints, holding the difference from the previous event in the frame (or from zero for the first one)
+         TimedEvents = 0x05,
+
+         // Client to server: control mask to subscribe to (64 bits), answered with a PartialState frame (or a State frame if subscribing to everything)
+         Subscribe = 0x06,
+
+         // Server to client: control mask (64 bits), followed by the raw value of every control in the mask, in control index order
+         PartialState = 0x07,
+
+         // Both directions, empty: sent with kCapabilityHeartbeats when nothing else has been sent for a heartbeat interval
+         Heartbeat = 0x08,
+
+         // Server to client, with kCapabilityResume: SyncType (8 bits), the server's epoch (64 bits), and the sequence number of the last event that the client is now up to date with (64 bits)
+         // Follows every State / PartialState frame, and comes first (before the missed events) when the server resumes a connection
+         Sync = 0x09
+      };
+
+      enum class SyncType : uint8_t
+      {
+         Snapshot = 0x00,
+         Delta = 0x01
+      };
+
+      constexpr std::size_t kSyncPayloadSize = 17;
+
+      // Events are encoded as a control index (buttons, then dials, then sliders, each in enum order) followed by the raw 7-bit value from the device
+      constexpr std::size_t kCompactEventSize = 2;
+      constexpr std::size_t kStatePayloadSize = kNumControls;
+
+      constexpr std::size_t kMaxVarintSize = 10;
+      constexpr std::size_t kMinTimedEventSize = kCompactEventSize + 2;
+      constexpr std::size_t kMaxTimedEventSize = kCompactEventSize + 2 * kMaxVarintSize;
+
+      std::optional<uint8_t> getControlIndex(const EventPacket& packet);
+      uint8_t getRawValue(const EventPacket& packet);
+      std::optional<EventPacket> makePacket(uint8_t controlIndex, uint8_t rawValue);
+
+      // Appends a frame header, the payload size is filled in by endFrame()
+      std::size_t beginFrame(std::vector<uint8_t>& buffer, FrameType type);
+      void endFrame(std::vector<uint8_t>& buffer, std::size_t frameOffset);
+
+      void appendUint32(std::vector<uint8_t>& buffer, uint32_t value);
+      uint32_t readUint32(const uint8_t* data);
+
+      void appendUint64(std::vector<uint8_t>& buffer, uint64_t value);
+      uint64_t readUint64(const uint8_t* data);
+
+      // Signed values are zigzag encoded, so that small negative numbers stay small
+      void appendVarint(std::vector<uint8_t>& buffer, int64_t value);
+
+      // Returns the number of bytes read, or 0 if the value is incomplete (or malformed)
+      std::size_t readVarint(const uint8_t* data, std::size_t size, int64_t& value);
+
+      struct Frame
+      {
+         FrameType type = FrameType::Hello;
+         const uint8_t* payload = nullptr;
+         std::size_t payloadSize = 0;
+      };
+
+      // Returns the total size of the frame at the start of the data, or 0 if it is incomplete
+      std::size_t parseFrame(const uint8_t* data, std::size_t size, Frame& frame);
+   }
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace Kontroller
+{
+   // Sequence lock protecting a fixed number of 32-bit words, for a single writer and any number of readers (which never block the writer)
+   // Only uses lock-free atomics, so it also works when placed in memory that is shared between processes
+   template<std::size_t NumWords>
+   class SeqLock
+   {
+   public:
+      static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free, "Sequence lock must be lock-free");
+
+      using Words = std::array<uint32_t, NumWords>;
+
+      // Writes must be wrapped in beginWrite() / endWrite() (and only made by one thread at a time)
+      void beginWrite()
+      {
+         sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+         std::atomic_thread_fence(std::memory_order_release);
+      }
+
+      void store(std::size_t index, uint32_t value)
+      {
+         words[index].store(value, std::memory_order_relaxed);
+      }
+
+      void endWrite()
+      {
+         sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+      }
+
+      // Copies a consistent set of words, returning the number of writes that have completed so far (which can be used to tell whether anything changed)
+      uint64_t read(Words& destination) const
+      {
+         while (true)
+         {
+            uint64_t before = sequence.load(std::memory_order_acquire);
+            if (before & 1)
+            {
+               continue;
+            }
+
+            for (std::size_t i = 0; i < NumWords; ++i)
+            {
+               destination[i] = words[i].load(std::memory_order_relaxed);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == before)
+            {
+               return before / 2;
+            }
+         }
+      }
+
+      // Like read(), but gives up after a number of attempts instead of waiting for a write to finish (so it never waits on a writer that was preempted part way through)
+      // The words are always copied, returns false if they might not all be from the same write
+      bool tryRead(Words& destination, uint64_t& version, int maxAttempts) const
+      {
+         for (int attempt = 1; ; ++attempt)
+         {
+            uint64_t before = sequence.load(std::memory_order_acquire);
+
+            for (std::size_t i = 0; i < NumWords; ++i)
+            {
+               destination[i] = words[i].load(std::memory_order_relaxed);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            bool consistent = (before & 1) == 0 && sequence.load(std::memory_order_relaxed) == before;
+            if (consistent || attempt >= maxAttempts)
+            {
+               version = before / 2;
+               return consistent;
+            }
+         }
+      }
+
+      uint64_t getVersion() const
+      {
+         return sequence.load(std::memory_order_acquire) / 2;
+      }
+
+   private:
+      std::atomic<uint64_t> sequence = { 0 };
+      std::array<std::atomic<uint32_t>, NumWords> words = {};
+   };
+}
@@ -1,18 +1,30 @@
 #include "Kontroller/Server.h"
 
 #include "Kontroller/Device.h"
+#include "Kontroller/Event.h"
 #include "Kontroller/Packet.h"
+#include "Kontroller/Subscription.h"
 
+#include "EventRing.h"
+#include "Poller.h"
+#include "Protocol.h"
+#include "SharedLayout.h"
+#include "SharedMemory.h"
 #include "Sock.h"
 
 #include <PlatformUtils/IOUtils.h>
 
-#include <cassert>
+#include <algorithm>
+#include <array>
 #include <cstdio>
 #include <cstring>
+#include <iterator>
 #include <limits>
+#include <new>
 #include <optional>
+#include <random>
 #include <sstream>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -104,65 +116,206 @@ namespace Kontroller
          return listenSocket;
       }
 
-      uint64_t encodeSocket(Sock::Socket socket)
+      Sock::Socket createUnixListenSocket(const std::filesystem::path& path, bool printErrors)
       {
-         static_assert(sizeof(Sock::Socket) <= sizeof(uint64_t), "Socket can not fit in a uint64_t");
+#if SOCK_UNIX_DOMAIN
+         sockaddr_un address;
+         socklen_t addressLength = 0;
+         if (!Sock::Helpers::makeUnixAddress(path.string().c_str(), address, addressLength))
+         {
+            if (printErrors)
+            {
+               fprintf(stderr, "Kontroller::Server - invalid unix socket path: %s\n", path.string().c_str());
+            }
+            return Sock::kInvalidSocket;
+         }
+
+         // A socket file left behind by a server that didn't shut down cleanly would prevent binding, but one that belongs to a running server must be left alone
+         std::error_code errorCode;
+         if (std::filesystem::is_socket(path, errorCode))
+         {
+            Sock::Socket probeSocket = Sock::socket(AF_UNIX, SOCK_STREAM, 0);
+            bool inUse = probeSocket != Sock::kInvalidSocket && Sock::connect(probeSocket, reinterpret_cast<sockaddr*>(&address), addressLength) == 0;
+            if (probeSocket != Sock::kInvalidSocket)
+            {
+               Sock::close(probeSocket);
+            }
+
+            if (inUse)
+            {
+               if (printErrors)
+               {
+                  fprintf(stderr, "Kontroller::Server - unix socket is already in use: %s\n", path.string().c_str());
+               }
+               return Sock::kInvalidSocket;
+            }
+
+            std::filesystem::remove(path, errorCode);
+         }
 
-         uint64_t encodedSocket = 0;
-         memcpy(&encodedSocket, &socket, sizeof(socket));
+         Sock::Socket listenSocket = Sock::socket(AF_UNIX, SOCK_STREAM, 0);
+         if (listenSocket == Sock::kInvalidSocket)
+         {
+            if (printErrors)
+            {
+               fprintf(stderr, "Kontroller::Server - socket failed with error: %d\n", Sock::System::getLastError());
+            }
+            return Sock::kInvalidSocket;
+         }
+
+         unsigned long nonBlocking = 1;
+         if (Sock::ioctl(listenSocket, FIONBIO, &nonBlocking) == Sock::kSocketError
+            || Sock::bind(listenSocket, reinterpret_cast<sockaddr*>(&address), addressLength) == Sock::kSocketError
+            || Sock::listen(listenSocket, SOMAXCONN) == Sock::kSocketError)
+         {
+            if (printErrors)
+            {
+               fprintf(stderr, "Kontroller::Server - unable to listen on unix socket %s, error: %d\n", path.string().c_str(), Sock::System::getLastError());
+            }
+
+            Sock::close(listenSocket);
+            return Sock::kInvalidSocket;
+         }
 
-         return encodedSocket;
+         return listenSocket;
+#else
+         return Sock::kInvalidSocket;
+#endif
       }
 
-      Sock::Socket decodeSocket(uint64_t encodedSocket)
+#if defined(MSG_NOSIGNAL)
+      constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+      constexpr int kSendFlags = 0;
+#endif
+
+      constexpr int kMaxEventsPerWait = 64;
+      constexpr std::size_t kMaxConflatedButtonEvents = 256;
+
+      int getAddressFamily(Sock::Socket socket)
       {
-         Sock::Socket socket = Sock::kInvalidSocket;
-         memcpy(&socket, &encodedSocket, sizeof(socket));
+         sockaddr_storage address = {};
+         socklen_t addressLength = sizeof(address);
+         if (Sock::getsockname(socket, reinterpret_cast<sockaddr*>(&address), &addressLength) == Sock::kSocketError)
+         {
+            return AF_UNSPEC;
+         }
 
-         return socket;
+         return address.ss_family;
       }
 
-      bool sendData(Sock::Socket socket, const uint8_t* data, size_t size)
+      uint64_t makeEpoch()
       {
-         size_t bytesWritten = 0;
+         // Mixed with the time, in case the random device is deterministic on this platform
+         std::random_device randomDevice;
+         uint64_t random = (static_cast<uint64_t>(randomDevice()) << 32) | randomDevice();
+         return random ^ static_cast<uint64_t>(std::chrono::system_clock::now().time_since_epoch().count());
+      }
 
-         while (bytesWritten < size)
+      bool configureClientSocket(Sock::Socket socket, bool printErrors)
+      {
+         unsigned long nonBlocking = 1;
+         int ioctrlResult = Sock::ioctl(socket, FIONBIO, &nonBlocking);
+         if (ioctrlResult == Sock::kSocketError)
          {
-            Sock::SignedResult result = Sock::send(socket, data + bytesWritten, static_cast<Sock::Length>(size - bytesWritten), 0);
-            if (result == Sock::kSocketError)
+            if (printErrors)
             {
-               // Connection lost
-               return false;
+               fprintf(stderr, "Kontroller::Server - ioctl failed with error: %d\n", Sock::System::getLastError());
             }
+            return false;
+         }
 
-            assert(result > 0);
-            bytesWritten += result;
+#if defined(SO_NOSIGPIPE)
+         int noSigPipe = 1;
+         Sock::setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+
+#if SOCK_UNIX_DOMAIN
+         // Unix domain sockets have no Nagle algorithm to disable
+         if (getAddressFamily(socket) == AF_UNIX)
+         {
+            return true;
+         }
+#endif
+
+         int tcpNoDelay = 1;
+         int optResult = Sock::setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &tcpNoDelay, sizeof(tcpNoDelay));
+         if (optResult == Sock::kSocketError && printErrors)
+         {
+            fprintf(stderr, "Kontroller::Server - unable to disable the Nagle algorithm, connection may be jittery!\n");
          }
 
          return true;
       }
 
-      bool sendPacket(Sock::Socket socket, EventPacket packet)
+      // Covers clients that don't send heartbeats (a unix domain socket's peer can't vanish without the socket being closed)
+      void configureKeepAlive(Sock::Socket socket, int idleTimeoutMS, bool printErrors)
+      {
+#if SOCK_UNIX_DOMAIN
+         if (getAddressFamily(socket) == AF_UNIX)
+         {
+            return;
+         }
+#endif
+
+         if (idleTimeoutMS > 0 && !Sock::Helpers::enableKeepAlive(socket, idleTimeoutMS) && printErrors)
+         {
+            fprintf(stderr, "Kontroller::Server - unable to enable keepalive, dead connections may linger!\n");
+         }
+      }
+
+      // Clients are identified by address only (not port), so that reconnections are counted together
+      std::string getPeerAddress(Sock::Socket socket)
+      {
+#if SOCK_UNIX_DOMAIN
+         if (getAddressFamily(socket) == AF_UNIX)
+         {
+            return "unix";
+         }
+#endif
+
+         sockaddr_storage address = {};
+         socklen_t addressLength = sizeof(address);
+         if (Sock::getpeername(socket, reinterpret_cast<sockaddr*>(&address), &addressLength) == Sock::kSocketError || address.ss_family != AF_INET)
+         {
+            return "unknown";
+         }
+
+         uint32_t ip = Sock::Endian::networkToHostLong(reinterpret_cast<const sockaddr_in*>(&address)->sin_addr.s_addr);
+
+         std::array<char, 16> text;
+         snprintf(text.data(), text.size(), "%u.%u.%u.%u", (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF);
+         return text.data();
+      }
+
+      void encodePacket(uint8_t* destination, EventPacket packet)
       {
          EventPacket networkPacket;
          networkPacket.type = Sock::Endian::hostToNetworkShort(packet.type);
          networkPacket.id = Sock::Endian::hostToNetworkShort(packet.id);
          networkPacket.value = Sock::Endian::hostToNetworkLong(packet.value);
 
-         return sendData(socket, reinterpret_cast<const uint8_t*>(&networkPacket), sizeof(networkPacket));
+         memcpy(destination, &networkPacket, sizeof(networkPacket));
+      }
+
+      void appendPacket(std::vector<uint8_t>& buffer, EventPacket packet)
+      {
+         std::size_t offset = buffer.size();
+         buffer.resize(offset + sizeof(EventPacket));
+         encodePacket(buffer.data() + offset, packet);
       }
 
-      bool sendButtonEvent(Sock::Socket socket, const Server::ButtonEvent& buttonEvent)
+      EventPacket makePacket(const Server::ButtonEvent& buttonEvent)
       {
          EventPacket packet;
          packet.type = EventPacket::Button;
          packet.id = static_cast<uint16_t>(buttonEvent.button);
          packet.value = static_cast<uint32_t>(buttonEvent.pressed);
 
-         return sendPacket(socket, packet);
+         return packet;
       }
 
-      bool sendDialEvent(Sock::Socket socket, const Server::DialEvent& dialEvent)
+      EventPacket makePacket(const Server::DialEvent& dialEvent)
       {
          EventPacket packet;
          packet.type = EventPacket::Dial;
@@ -170,10 +323,10 @@ namespace Kontroller
          static_assert(sizeof(packet.value) == sizeof(dialEvent.value), "Packet data size does not match event data size");
          memcpy(&packet.value, &dialEvent.value, sizeof(packet.value));
 
-         return sendPacket(socket, packet);
+         return packet;
       }
 
-      bool sendSliderEvent(Sock::Socket socket, const Server::SliderEvent& sliderEvent)
+      EventPacket makePacket(const Server::SliderEvent& sliderEvent)
       {
          EventPacket packet;
          packet.type = EventPacket::Slider;
@@ -181,172 +334,1416 @@ namespace Kontroller
          static_assert(sizeof(packet.value) == sizeof(sliderEvent.value), "Packet data size does not match event data size");
          memcpy(&packet.value, &sliderEvent.value, sizeof(packet.value));
 
-         return sendPacket(socket, packet);
+         return packet;
+      }
+
+      EventPacket makePacket(const Event& event)
+      {
+         if (event.button != Button::None)
+         {
+            return makePacket(Server::ButtonEvent{ event.button, event.pressed });
+         }
+
+         if (event.dial != Dial::None)
+         {
+            return makePacket(Server::DialEvent{ event.dial, event.value });
+         }
+
+         return makePacket(Server::SliderEvent{ event.slider, event.value });
+      }
+
+      // Snapshots are kept in both protocols' encodings
+      void updateSnapshot(uint8_t* snapshot, uint8_t* compactSnapshot, const EventPacket& packet)
+      {
+         if (std::optional<uint8_t> index = Protocol::getControlIndex(packet))
+         {
+            encodePacket(snapshot + index.value() * sizeof(EventPacket), packet);
+            compactSnapshot[index.value()] = Protocol::getRawValue(packet);
+         }
+      }
+
+      template<typename Function>
+      void forEachControlPacket(State state, Function&& function)
+      {
+         for (uint8_t i = 1; i <= kNumButtons; ++i)
+         {
+            Button button = static_cast<Button>(i);
+            function(makePacket(Server::ButtonEvent{ button, *state.getButtonPointer(button) }));
+         }
+
+         for (uint8_t i = 1; i <= kNumDials; ++i)
+         {
+            Dial dial = static_cast<Dial>(i);
+            function(makePacket(Server::DialEvent{ dial, *state.getDialPointer(dial) }));
+         }
+
+         for (uint8_t i = 1; i <= kNumSliders; ++i)
+         {
+            Slider slider = static_cast<Slider>(i);
+            function(makePacket(Server::SliderEvent{ slider, *state.getSliderPointer(slider) }));
+         }
+      }
+
+      void encodeSnapshot(uint8_t* snapshot, uint8_t* compactSnapshot, State state)
+      {
+         forEachControlPacket(state, [snapshot, compactSnapshot](const EventPacket& packet)
+         {
+            updateSnapshot(snapshot, compactSnapshot, packet);
+         });
+      }
+
+      // The shared state uses the same control order (and values) as the snapshot, must be called between beginWrite() and endWrite()
+      void updateSharedState(SharedStateBlock& block, const EventPacket& packet, uint64_t sequence)
+      {
+         if (std::optional<uint8_t> index = Protocol::getControlIndex(packet))
+         {
+            block.lock.store(index.value(), packet.value);
+         }
+
+         block.lock.store(SharedStateBlock::kSequenceWord, static_cast<uint32_t>(sequence));
+         block.lock.store(SharedStateBlock::kSequenceWord + 1, static_cast<uint32_t>(sequence >> 32));
+      }
+
+      template<typename Block>
+      Block* createSharedBlock(std::unique_ptr<SharedMemory>& memory, const std::string& name, bool printErrors)
+      {
+         memory = std::make_unique<SharedMemory>(name, sizeof(Block), SharedMemory::Mode::Create);
+         if (!memory->isValid())
+         {
+            if (printErrors)
+            {
+               fprintf(stderr, "Kontroller::Server - unable to create shared memory: %s\n", name.c_str());
+            }
+
+            memory.reset();
+            return nullptr;
+         }
+
+         return new (memory->getData()) Block;
+      }
+
+      // Fixed size backlog for a client that isn't keeping up, where newer values of a control replace older ones
+      // Button events are kept in order (up to a limit, after which they are conflated as well), since every press matters
+      class ConflatedEvents
+      {
+      public:
+         static_assert(kNumControls <= 64, "Dirty mask is too small");
+
+         bool isEmpty() const
+         {
+            return dirtyMask == 0 && numButtonEvents == 0;
+         }
+
+         bool isButtonQueueFull() const
+         {
+            return numButtonEvents == buttonEvents.size();
+         }
+
+         // Returns the number of older events that were replaced
+         std::size_t add(const SequencedEvent& event)
+         {
+            std::optional<uint8_t> index = Protocol::getControlIndex(event.packet);
+            if (!index.has_value())
+            {
+               return 0;
+            }
+
+            std::size_t numReplaced = 0;
+            uint64_t bit = 1ull << index.value();
+            if (event.packet.type == EventPacket::Button && !(dirtyMask & bit))
+            {
+               if (numButtonEvents < buttonEvents.size())
+               {
+                  buttonEvents[numButtonEvents++] = event;
+                  return 0;
+               }
+
+               // Out of room, so collapse the queued presses into the latest state of each button
+               for (std::size_t i = 0; i < numButtonEvents; ++i)
+               {
+                  std::size_t buttonIndex = Protocol::getControlIndex(buttonEvents[i].packet).value();
+                  numReplaced += (dirtyMask & (1ull << buttonIndex)) ? 1 : 0;
+
+                  latestEvents[buttonIndex] = buttonEvents[i];
+                  dirtyMask |= 1ull << buttonIndex;
+               }
+               numButtonEvents = 0;
+            }
+
+            numReplaced += (dirtyMask & bit) ? 1 : 0;
+            latestEvents[index.value()] = event;
+            dirtyMask |= bit;
+
+            return numReplaced;
+         }
+
+         // Everything goes out in the order the device produced it, with a conflated value taking the place of the latest change it replaced
+         template<typename Function>
+         void drain(Function&& function)
+         {
+            std::array<const SequencedEvent*, kNumControls> conflated;
+            std::size_t numConflated = 0;
+            for (std::size_t i = 0; i < latestEvents.size(); ++i)
+            {
+               if (dirtyMask & (1ull << i))
+               {
+                  conflated[numConflated++] = &latestEvents[i];
+               }
+            }
+
+            std::sort(conflated.begin(), conflated.begin() + numConflated, [](const SequencedEvent* first, const SequencedEvent* second)
+            {
+               return first->sequence < second->sequence;
+            });
+
+            // The button queue is already in order, so just merge the two
+            std::size_t conflatedIndex = 0;
+            std::size_t buttonIndex = 0;
+            while (conflatedIndex < numConflated || buttonIndex < numButtonEvents)
+            {
+               bool takeButton = conflatedIndex == numConflated || (buttonIndex < numButtonEvents && buttonEvents[buttonIndex].sequence < conflated[conflatedIndex]->sequence);
+               function(takeButton ? buttonEvents[buttonIndex++] : *conflated[conflatedIndex++]);
+            }
+
+            clear();
+         }
+
+         void clear()
+         {
+            dirtyMask = 0;
+            numButtonEvents = 0;
+         }
+
+      private:
+         std::array<SequencedEvent, kNumControls> latestEvents;
+         uint64_t dirtyMask = 0;
+
+         std::array<SequencedEvent, kMaxConflatedButtonEvents> buttonEvents;
+         std::size_t numButtonEvents = 0;
+      };
+
+      // How events are encoded for a connection, depending on its protocol version and capabilities
+      enum class EventFormat : uint8_t
+      {
+         Packets,
+         Compact,
+         Timed,
+
+         Count
+      };
+
+      EventFormat getEventFormat(uint8_t protocolVersion, uint32_t capabilities)
+      {
+         if (protocolVersion < 2)
+         {
+            return EventFormat::Packets;
+         }
+
+         return (capabilities & Protocol::kCapabilityTimedEvents) ? EventFormat::Timed : EventFormat::Compact;
+      }
+
+      // Timed events vary in size, so use the smallest possible size (which overestimates how many events a buffer holds)
+      std::size_t getEventSize(EventFormat format)
+      {
+         switch (format)
+         {
+         case EventFormat::Packets:
+            return sizeof(EventPacket);
+         case EventFormat::Compact:
+            return Protocol::kCompactEventSize;
+         default:
+            return Protocol::kMinTimedEventSize;
+         }
+      }
+
+      // Encodes the events a connection is subscribed to in its format (version 2 events are wrapped in a frame, which is dropped again if it ends up empty)
+      class EventWriter
+      {
+      public:
+         EventWriter(std::vector<uint8_t>& destination, EventFormat eventFormat, uint64_t subscribedControls)
+            : buffer(destination)
+            , format(eventFormat)
+            , subscription(subscribedControls)
+         {
+            if (format != EventFormat::Packets)
+            {
+               frameOffset = Protocol::beginFrame(buffer, format == EventFormat::Timed ? Protocol::FrameType::TimedEvents : Protocol::FrameType::Events);
+            }
+         }
+
+         bool isFull() const
+         {
+            std::size_t payloadSize = buffer.size() - frameOffset - Protocol::kFrameHeaderSize;
+            switch (format)
+            {
+            case EventFormat::Compact:
+               return payloadSize + Protocol::kCompactEventSize > Protocol::kMaxFramePayloadSize;
+            case EventFormat::Timed:
+               return payloadSize + Protocol::kMaxTimedEventSize > Protocol::kMaxFramePayloadSize;
+            default:
+               return false;
+            }
+         }
+
+         std::size_t getNumEvents() const
+         {
+            return numEvents;
+         }
+
+         void add(const SequencedEvent& event)
+         {
+            std::optional<uint8_t> index = Protocol::getControlIndex(event.packet);
+            if (!index.has_value() || (subscription & (1ull << index.value())) == 0)
+            {
+               return;
+            }
+
+            if (format == EventFormat::Packets)
+            {
+               appendPacket(buffer, event.packet);
+               ++numEvents;
+            }
+            else
+            {
+               buffer.push_back(index.value());
+               buffer.push_back(Protocol::getRawValue(event.packet));
+               ++numEvents;
+
+               if (format == EventFormat::Timed)
+               {
+                  Protocol::appendVarint(buffer, static_cast<int64_t>(event.sequence - previousSequence));
+                  Protocol::appendVarint(buffer, static_cast<int64_t>(event.timestamp - previousTimestamp));
+                  previousSequence = event.sequence;
+                  previousTimestamp = event.timestamp;
+               }
+            }
+         }
+
+         void finish()
+         {
+            if (format != EventFormat::Packets)
+            {
+               if (numEvents == 0)
+               {
+                  buffer.resize(frameOffset);
+               }
+               else
+               {
+                  Protocol::endFrame(buffer, frameOffset);
+               }
+            }
+         }
+
+      private:
+         std::vector<uint8_t>& buffer;
+         const EventFormat format;
+         const uint64_t subscription;
+         std::size_t frameOffset = 0;
+         std::size_t numEvents = 0;
+
+         uint64_t previousSequence = 0;
+         uint64_t previousTimestamp = 0;
+      };
+
+      std::optional<Kontroller::State> loadStateFromFile(const std::optional<std::filesystem::path>& path)
+      {
+         if (!path.has_value())
+         {
+            return std::nullopt;
+         }
+
+         std::optional<std::string> text = IOUtils::readTextFile(path.value());
+         if (!text.has_value())
+         {
+            return std::nullopt;
+         }
+
+         std::stringstream ss(text.value());
+
+         Kontroller::State state;
+         for (Kontroller::Group& group : state.groups)
+         {
+            ss >> group.dial;
+            if (ss.fail())
+            {
+               return std::nullopt;
+            }
+
+            ss >> group.slider;
+            if (ss.fail())
+            {
+               return std::nullopt;
+            }
+         }
+
+         return state;
+      }
+
+      bool saveStateToFile(const Kontroller::State& state, const std::optional<std::filesystem::path>& path)
+      {
+         if (!path.has_value())
+         {
+            return false;
+         }
+
+         std::stringstream ss;
+         ss.precision(std::numeric_limits<double>::digits10 + 1);
+
+         for (const Kontroller::Group& group : state.groups)
+         {
+            ss << group.dial << "\n" << group.slider << "\n\n";
+         }
+
+         return IOUtils::writeTextFile(path.value(), ss.str());
+      }
+   }
+
+   struct Server::Connection
+   {
+      Sock::Socket socket = Sock::kInvalidSocket;
+      bool closed = false;
+
+      std::string address;
+      ClientCounters* counters = nullptr;
+
+      // Zero until the client has said hello (or the server gave up waiting for it and assumed version 1)
+      uint8_t protocolVersion = 0;
+      TimePoint helloDeadline;
+      std::vector<uint8_t> inBuffer;
+
+      // Set when version 1 was assumed, until it's known whether the client's first bytes were a late hello
+      bool helloTimedOut = false;
+
+      EventFormat eventFormat = EventFormat::Packets;
+
+      // Controls that the client wants events for (only version 2 clients can narrow this down)
+      uint64_t subscription = Subscription::kAllControls;
+
+      // Zero for no limit, otherwise changes are collected per control and sent at most once per interval
+      // Updates go out on multiples of the interval (on the steady clock), so that connections with the same rate are flushed together
+      Clock::duration updateInterval = Clock::duration::zero();
+      TimePoint nextFlushTime;
+
+      // Sequence number of the next event (in the server's event ring) to send
+      uint64_t nextSequence = 0;
+
+      // Set when the client asked to resume from a previous connection (to this run of the server)
+      std::optional<uint64_t> resumeSequence;
+      bool sendsSync = false;
+
+      // Encoded data that has not yet been accepted by the socket
+      std::vector<uint8_t> outBuffer;
+      std::size_t outOffset = 0;
+      bool waitingForWrite = false;
+
+      // Events read from the ring ahead of the socket (only used with BackpressurePolicy::Conflate)
+      ConflatedEvents conflatedEvents;
+
+      // Set when events the connection needed were overwritten in the ring, the current snapshot is sent once the socket is ready for it
+      bool needsResync = false;
+
+      // Only tracked for connections that agreed to exchange heartbeats
+      bool heartbeats = false;
+      TimePoint lastReceiveTime;
+      TimePoint lastSendTime;
+   };
+
+   struct Server::Reactor
+   {
+      Reactor(Server& owningServer)
+         : server(owningServer)
+      {
+      }
+
+      void queueIncoming(Sock::Socket socket);
+      void adoptIncoming();
+
+      void openConnection(Sock::Socket socket);
+      void removeClosedConnections();
+      void closeAllConnections();
+
+      void receive(Connection& connection);
+      void processInput(Connection& connection);
+      void startStreaming(Connection& connection, uint8_t protocolVersion, uint32_t capabilities);
+      bool resume(Connection& connection);
+      void sendSync(Connection& connection, Protocol::SyncType type);
+      void checkHelloDeadlines(TimePoint now);
+      std::optional<TimePoint> getNextHelloDeadline() const;
+      void checkHeartbeats(TimePoint now);
+      std::optional<TimePoint> getNextHeartbeatTime() const;
+      void changeSubscription(Connection& connection, uint64_t subscription);
+      void updateSubscriptions();
+      void sendState(Connection& connection);
+      void prepareBatch();
+      void service(Connection& connection, TimePoint now);
+      void serviceRateLimited(Connection& connection, TimePoint now);
+      std::optional<TimePoint> getNextFlushTime() const;
+      void applyBackpressure(Connection& connection);
+      void conflate(Connection& connection);
+      void resync(Connection& connection);
+      void send(Connection& connection, const uint8_t* data, std::size_t size);
+      void flush(Connection& connection);
+      std::size_t sendNow(Connection& connection, const uint8_t* data, std::size_t size);
+      void updateWriteInterest(Connection& connection);
+
+      Server& server;
+      Poller poller;
+      std::thread thread;
+
+      // Events encoded once per pass (for every combination of format and subscription in use), shared by every connection that is caught up (covers sequence numbers [batchStart, batchEnd))
+      struct Batch
+      {
+         EventFormat format = EventFormat::Packets;
+         uint64_t subscription = Subscription::kAllControls;
+
+         std::vector<uint8_t> data;
+         std::size_t numEvents = 0;
+         bool inUse = false;
+      };
+
+      Batch* findBatch(EventFormat format, uint64_t subscription);
+
+      std::vector<Batch> batches;
+      uint64_t batchStart = EventRing<kEventRingCapacity>::kFirstSequence;
+      uint64_t batchEnd = EventRing<kEventRingCapacity>::kFirstSequence;
+      TimePoint lastBatchTime;
+
+      // Only modified by the thread running this reactor, while holding the server's connectionsMutex
+      std::vector<std::unique_ptr<Connection>> connections;
+      std::atomic<std::size_t> numConnections = { 0 };
+      std::size_t numAwaitingHello = 0;
+      std::size_t numRateLimited = 0;
+      std::size_t numWithHeartbeats = 0;
+      TimePoint nextHeartbeatTime;
+
+      // Union of every connection's subscription, so that the server only wakes this reactor for events that somebody cares about
+      std::atomic<uint64_t> subscriptions = { 0 };
+
+      // Sequence number of the last event that woke this reactor up (only used by Server::publishEvent(), on the device's thread)
+      uint64_t lastWakeSequence = 0;
+
+      std::mutex incomingMutex;
+      std::vector<Sock::Socket> incomingSockets;
+   };
+
+   void Server::Reactor::queueIncoming(Sock::Socket socket)
+   {
+      {
+         std::lock_guard<std::mutex> lock(incomingMutex);
+         incomingSockets.push_back(socket);
+      }
+
+      ++numConnections;
+      poller.wake();
+   }
+
+   void Server::Reactor::adoptIncoming()
+   {
+      std::vector<Sock::Socket> sockets;
+      {
+         std::lock_guard<std::mutex> lock(incomingMutex);
+         sockets.swap(incomingSockets);
+      }
+
+      for (Sock::Socket socket : sockets)
+      {
+         --numConnections;
+         openConnection(socket);
+      }
+   }
+
+   void Server::Reactor::openConnection(Sock::Socket socket)
+   {
+      std::unique_ptr<Connection> connection = std::make_unique<Connection>();
+      connection->socket = socket;
+      connection->address = getPeerAddress(socket);
+
+      if (!configureClientSocket(socket, server.settings.printErrorMessages) || !poller.add(socket, Poller::Readable, connection.get()))
+      {
+         Sock::shutdown(socket, Sock::ShutdownMethod::ReadWrite);
+         Sock::close(socket);
+         return;
+      }
+
+      Connection* newConnection = connection.get();
+      {
+         std::lock_guard<std::mutex> lock(server.connectionsMutex);
+         newConnection->counters = &server.clientCounters[newConnection->address];
+         ++newConnection->counters->numConnections;
+
+         connections.push_back(std::move(connection));
+         ++numConnections;
+      }
+
+      // Nobody needs anything from before the first connection's starting point
+      if (connections.size() == 1)
+      {
+         batches.clear();
+         batchStart = batchEnd = server.eventRing->getNextSequence();
+      }
+
+      updateSubscriptions();
+
+      // Nothing is sent until the client says which protocol it speaks (version 1 clients never say anything, so only wait for a short while)
+      if (server.settings.helloTimeoutMilliseconds > 0)
+      {
+         newConnection->helloDeadline = Clock::now() + std::chrono::milliseconds(server.settings.helloTimeoutMilliseconds);
+         ++numAwaitingHello;
+      }
+      else
+      {
+         startStreaming(*newConnection, 1, 0);
+      }
+   }
+
+   void Server::Reactor::removeClosedConnections()
+   {
+      if (std::none_of(connections.begin(), connections.end(), [](const std::unique_ptr<Connection>& connection) { return connection->closed; }))
+      {
+         return;
+      }
+
+      std::vector<std::unique_ptr<Connection>> closedConnections;
+      {
+         std::lock_guard<std::mutex> lock(server.connectionsMutex);
+
+         auto firstClosed = std::stable_partition(connections.begin(), connections.end(), [](const std::unique_ptr<Connection>& connection) { return !connection->closed; });
+         std::move(firstClosed, connections.end(), std::back_inserter(closedConnections));
+         connections.erase(firstClosed, connections.end());
+         numConnections -= closedConnections.size();
+
+         for (std::unique_ptr<Connection>& connection : closedConnections)
+         {
+            --connection->counters->numConnections;
+            if (connection->protocolVersion == 0 && server.settings.helloTimeoutMilliseconds > 0)
+            {
+               --numAwaitingHello;
+            }
+            if (connection->updateInterval > Clock::duration::zero())
+            {
+               --numRateLimited;
+            }
+            if (connection->heartbeats)
+            {
+               --numWithHeartbeats;
+            }
+         }
+      }
+
+      updateSubscriptions();
+
+      for (std::unique_ptr<Connection>& connection : closedConnections)
+      {
+         poller.remove(connection->socket);
+         Sock::shutdown(connection->socket, Sock::ShutdownMethod::ReadWrite);
+         Sock::close(connection->socket);
+      }
+   }
+
+   void Server::Reactor::closeAllConnections()
+   {
+      adoptIncoming();
+
+      for (std::unique_ptr<Connection>& connection : connections)
+      {
+         connection->closed = true;
+      }
+      removeClosedConnections();
+   }
+
+   void Server::Reactor::receive(Connection& connection)
+   {
+      // Version 1 clients never send anything meaningful, but the socket still needs to be drained (and read to detect disconnection)
+      std::array<uint8_t, 256> buffer;
+      bool receivedData = false;
+      while (!connection.closed)
+      {
+         Sock::SignedResult result = Sock::recv(connection.socket, buffer.data(), static_cast<Sock::Length>(buffer.size()), 0);
+         receivedData |= result > 0;
+         if (result == 0)
+         {
+            connection.closed = true;
+         }
+         else if (result < 0)
+         {
+            if (Sock::System::getLastError() != Sock::WouldBlock)
+            {
+               connection.closed = true;
+            }
+            break;
+         }
+         else if (connection.protocolVersion != 1 || connection.helloTimedOut)
+         {
+            connection.inBuffer.insert(connection.inBuffer.end(), buffer.data(), buffer.data() + result);
+         }
+      }
+
+      // Any data counts as a sign of life, heartbeat or not
+      if (receivedData && connection.heartbeats)
+      {
+         connection.lastReceiveTime = Clock::now();
+      }
+
+      processInput(connection);
+   }
+
+   void Server::Reactor::processInput(Connection& connection)
+   {
+      std::size_t offset = 0;
+
+      if (connection.protocolVersion == 0)
+      {
+         // Anything other than the magic means that this is a version 1 client (which shouldn't be sending anything in the first place)
+         std::size_t numToCompare = std::min(connection.inBuffer.size(), Protocol::kMagic.size());
+         if (!std::equal(connection.inBuffer.begin(), connection.inBuffer.begin() + numToCompare, Protocol::kMagic.begin()))
+         {
+            connection.inBuffer.clear();
+            startStreaming(connection, 1, 0);
+            return;
+         }
+
+         Protocol::Frame frame;
+         std::size_t frameSize = numToCompare < Protocol::kMagic.size() ? 0 : Protocol::parseFrame(connection.inBuffer.data() + Protocol::kMagic.size(), connection.inBuffer.size() - Protocol::kMagic.size(), frame);
+         if (frameSize == 0)
+         {
+            return;
+         }
+
+         bool isHello = frame.type == Protocol::FrameType::Hello;
+         uint8_t clientVersion = isHello && frame.payloadSize >= 1 ? frame.payload[0] : 1;
+         uint32_t clientCapabilities = isHello && frame.payloadSize >= 5 ? Protocol::readUint32(frame.payload + 1) : 0;
+         if (isHello && frame.payloadSize >= 13)
+         {
+            connection.subscription = Protocol::readUint64(frame.payload + 5) & Subscription::kAllControls;
+            updateSubscriptions();
+         }
+         if (isHello && frame.payloadSize >= 15)
+         {
+            uint16_t maxUpdateRate = static_cast<uint16_t>((frame.payload[13] << 8) | frame.payload[14]);
+            if (maxUpdateRate > 0)
+            {
+               connection.updateInterval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / maxUpdateRate));
+               ++numRateLimited;
+            }
+         }
+         if (isHello && frame.payloadSize >= 31 && Protocol::readUint64(frame.payload + 15) == server.epoch)
+         {
+            connection.resumeSequence = Protocol::readUint64(frame.payload + 23) + 1;
+         }
+         startStreaming(connection, std::min(clientVersion, Protocol::kVersion), clientCapabilities);
+         offset = Protocol::kMagic.size() + frameSize;
+      }
+
+      if (connection.protocolVersion >= 2)
+      {
+         // Unknown frames are skipped, so that newer clients can send more
+         Protocol::Frame frame;
+         while (std::size_t frameSize = Protocol::parseFrame(connection.inBuffer.data() + offset, connection.inBuffer.size() - offset, frame))
+         {
+            offset += frameSize;
+
+            // Heartbeats only matter for having arrived at all (see receive())
+            if (frame.type == Protocol::FrameType::Subscribe && frame.payloadSize >= 8)
+            {
+               changeSubscription(connection, Protocol::readUint64(frame.payload) & Subscription::kAllControls);
+            }
+         }
+      }
+
+      if (connection.protocolVersion == 1 && connection.helloTimedOut)
+      {
+         // Too late to switch versions, since the client has already been sent the version 1 state, but worth knowing about
+         std::size_t numToCompare = std::min(connection.inBuffer.size(), Protocol::kMagic.size());
+         bool isHello = std::equal(connection.inBuffer.begin(), connection.inBuffer.begin() + numToCompare, Protocol::kMagic.begin());
+         if (isHello && numToCompare < Protocol::kMagic.size())
+         {
+            return;
+         }
+
+         if (isHello)
+         {
+            ++connection.counters->lateHellos;
+            if (server.settings.printErrorMessages)
+            {
+               fprintf(stderr, "Kontroller::Server - hello from %s arrived after falling back to version 1 (helloTimeoutMilliseconds may be too short)\n", connection.address.c_str());
+            }
+         }
+         connection.helloTimedOut = false;
+      }
+
+      connection.inBuffer.erase(connection.inBuffer.begin(), connection.inBuffer.begin() + std::min(offset, connection.inBuffer.size()));
+      if (connection.protocolVersion == 1)
+      {
+         connection.inBuffer.clear();
+      }
+   }
+
+   void Server::Reactor::startStreaming(Connection& connection, uint8_t protocolVersion, uint32_t capabilities)
+   {
+      if (connection.protocolVersion != 0 || connection.closed)
+      {
+         return;
+      }
+
+      if (server.settings.helloTimeoutMilliseconds > 0)
+      {
+         --numAwaitingHello;
+      }
+      connection.protocolVersion = std::max<uint8_t>(protocolVersion, 1);
+
+      uint32_t acceptedCapabilities = connection.protocolVersion >= 2 ? capabilities & Protocol::kSupportedCapabilities : 0;
+      if (server.settings.heartbeatMilliseconds <= 0 || server.settings.idleTimeoutMilliseconds <= 0)
+      {
+         acceptedCapabilities &= ~Protocol::kCapabilityHeartbeats;
+      }
+      if (!(acceptedCapabilities & Protocol::kCapabilityTimedEvents))
+      {
+         acceptedCapabilities &= ~Protocol::kCapabilityResume;
+      }
+      connection.sendsSync = (acceptedCapabilities & Protocol::kCapabilityResume) != 0;
+      connection.eventFormat = getEventFormat(connection.protocolVersion, acceptedCapabilities);
+
+      if (acceptedCapabilities & Protocol::kCapabilityHeartbeats)
+      {
+         if (numWithHeartbeats == 0)
+         {
+            nextHeartbeatTime = Clock::now() + std::chrono::milliseconds(server.settings.heartbeatMilliseconds);
+         }
+
+         connection.heartbeats = true;
+         connection.lastReceiveTime = connection.lastSendTime = Clock::now();
+         ++numWithHeartbeats;
+      }
+      else
+      {
+         // Only once it's known that there won't be heartbeats, so that connections that have them aren't probed as well
+         configureKeepAlive(connection.socket, server.settings.idleTimeoutMilliseconds, server.settings.printErrorMessages);
+      }
+
+      if (connection.protocolVersion >= 2)
+      {
+         std::vector<uint8_t> welcome;
+         std::size_t frameOffset = Protocol::beginFrame(welcome, Protocol::FrameType::Welcome);
+         welcome.push_back(Protocol::kVersion);
+         Protocol::appendUint32(welcome, acceptedCapabilities);
+         if (connection.heartbeats)
+         {
+            uint16_t heartbeatMS = static_cast<uint16_t>(std::min(server.settings.heartbeatMilliseconds, 0xFFFF));
+            uint16_t idleTimeoutMS = static_cast<uint16_t>(std::min(server.settings.idleTimeoutMilliseconds, 0xFFFF));
+            welcome.push_back(static_cast<uint8_t>(heartbeatMS >> 8));
+            welcome.push_back(static_cast<uint8_t>(heartbeatMS & 0xFF));
+            welcome.push_back(static_cast<uint8_t>(idleTimeoutMS >> 8));
+            welcome.push_back(static_cast<uint8_t>(idleTimeoutMS & 0xFF));
+         }
+         Protocol::endFrame(welcome, frameOffset);
+
+         send(connection, welcome.data(), welcome.size());
+      }
+
+      if (!resume(connection))
+      {
+         sendState(connection);
+      }
+   }
+
+   bool Server::Reactor::resume(Connection& connection)
+   {
+      if (!connection.sendsSync || !connection.resumeSequence.has_value())
+      {
+         return false;
+      }
+
+      // Only possible while the ring still holds everything the client missed, and only worthwhile if that's not so much that the state would be cheaper
+      uint64_t resumeSequence = connection.resumeSequence.value();
+      uint64_t nextSequence = server.eventRing->getNextSequence();
+      if (resumeSequence > nextSequence || resumeSequence < server.eventRing->getOldestSequence() || nextSequence - resumeSequence > server.settings.maxResumeEvents)
+      {
+         return false;
+      }
+
+      // Anything that gets overwritten before it is sent results in a regular resync
+      connection.nextSequence = resumeSequence;
+      ++connection.counters->resumes;
+      sendSync(connection, Protocol::SyncType::Delta);
+
+      return true;
+   }
+
+   void Server::Reactor::sendSync(Connection& connection, Protocol::SyncType type)
+   {
+      std::vector<uint8_t> frame;
+      std::size_t frameOffset = Protocol::beginFrame(frame, Protocol::FrameType::Sync);
+      frame.push_back(static_cast<uint8_t>(type));
+      Protocol::appendUint64(frame, server.epoch);
+      Protocol::appendUint64(frame, connection.nextSequence - 1);
+      Protocol::endFrame(frame, frameOffset);
+
+      send(connection, frame.data(), frame.size());
+   }
+
+   void Server::Reactor::checkHelloDeadlines(TimePoint now)
+   {
+      if (numAwaitingHello == 0)
+      {
+         return;
+      }
+
+      for (std::unique_ptr<Connection>& connection : connections)
+      {
+         if (connection->protocolVersion == 0 && now >= connection->helloDeadline)
+         {
+            startStreaming(*connection, 1, 0);
+            connection->helloTimedOut = true;
+         }
+      }
+   }
+
+   std::optional<Server::TimePoint> Server::Reactor::getNextHelloDeadline() const
+   {
+      if (numAwaitingHello == 0)
+      {
+         return std::nullopt;
+      }
+
+      std::optional<TimePoint> nextDeadline;
+      for (const std::unique_ptr<Connection>& connection : connections)
+      {
+         if (connection->protocolVersion == 0 && (!nextDeadline.has_value() || connection->helloDeadline < nextDeadline.value()))
+         {
+            nextDeadline = connection->helloDeadline;
+         }
+      }
+
+      return nextDeadline;
+   }
+
+   void Server::Reactor::checkHeartbeats(TimePoint now)
+   {
+      if (numWithHeartbeats == 0 || now < nextHeartbeatTime)
+      {
+         return;
+      }
+
+      std::chrono::milliseconds heartbeatInterval(server.settings.heartbeatMilliseconds);
+      std::chrono::milliseconds idleTimeout(server.settings.idleTimeoutMilliseconds);
+      nextHeartbeatTime = now + heartbeatInterval;
+
+      for (std::unique_ptr<Connection>& connection : connections)
+      {
+         if (!connection->heartbeats || connection->closed)
+         {
+            continue;
+         }
+
+         if (now - connection->lastReceiveTime > idleTimeout)
+         {
+            if (server.settings.printErrorMessages)
+            {
+               fprintf(stderr, "Kontroller::Server - disconnecting %s, which hasn't been heard from in %d ms\n", connection->address.c_str(), server.settings.idleTimeoutMilliseconds);
+            }
+
+            ++connection->counters->idleTimeouts;
+            connection->closed = true;
+            continue;
+         }
+
+         // Data still waiting for the socket is going to reach the client before a heartbeat would anyway
+         if (connection->outBuffer.empty() && now - connection->lastSendTime >= heartbeatInterval)
+         {
+            std::vector<uint8_t> heartbeat;
+            std::size_t frameOffset = Protocol::beginFrame(heartbeat, Protocol::FrameType::Heartbeat);
+            Protocol::endFrame(heartbeat, frameOffset);
+            send(*connection, heartbeat.data(), heartbeat.size());
+         }
+      }
+   }
+
+   std::optional<Server::TimePoint> Server::Reactor::getNextHeartbeatTime() const
+   {
+      if (numWithHeartbeats == 0)
+      {
+         return std::nullopt;
+      }
+
+      return nextHeartbeatTime;
+   }
+
+   void Server::Reactor::changeSubscription(Connection& connection, uint64_t subscription)
+   {
+      if (subscription == connection.subscription)
+      {
+         return;
+      }
+
+      // The client needs the current values of any newly subscribed controls, so start it over from the current state (which also covers anything it was behind on)
+      connection.subscription = subscription;
+      connection.conflatedEvents.clear();
+      connection.needsResync = false;
+      sendState(connection);
+
+      updateSubscriptions();
+   }
+
+   void Server::Reactor::updateSubscriptions()
+   {
+      uint64_t newSubscriptions = 0;
+      for (const std::unique_ptr<Connection>& connection : connections)
+      {
+         newSubscriptions |= connection->subscription;
+      }
+
+      subscriptions.store(newSubscriptions);
+   }
+
+   Server::Reactor::Batch* Server::Reactor::findBatch(EventFormat format, uint64_t subscription)
+   {
+      for (Batch& batch : batches)
+      {
+         if (batch.format == format && batch.subscription == subscription)
+         {
+            return &batch;
+         }
+      }
+
+      return nullptr;
+   }
+
+   void Server::Reactor::sendState(Connection& connection)
+   {
+      // The snapshot is tagged with the last event it includes, so that the connection receives every event after it exactly once
+      if (connection.protocolVersion >= 2 && connection.subscription != Subscription::kAllControls)
+      {
+         CompactSnapshot compactSnapshot;
+         connection.nextSequence = server.copySnapshot(compactSnapshot);
+
+         std::vector<uint8_t> frame;
+         std::size_t frameOffset = Protocol::beginFrame(frame, Protocol::FrameType::PartialState);
+         Protocol::appendUint64(frame, connection.subscription);
+         for (std::size_t i = 0; i < compactSnapshot.size(); ++i)
+         {
+            if (connection.subscription & (1ull << i))
+            {
+               frame.push_back(compactSnapshot[i]);
+            }
+         }
+         Protocol::endFrame(frame, frameOffset);
+
+         send(connection, frame.data(), frame.size());
+      }
+      else if (connection.protocolVersion >= 2)
+      {
+         CompactSnapshot compactSnapshot;
+         connection.nextSequence = server.copySnapshot(compactSnapshot);
+
+         std::array<uint8_t, Protocol::kFrameHeaderSize + Protocol::kStatePayloadSize> frame;
+         frame[0] = static_cast<uint8_t>(Protocol::FrameType::State);
+         frame[1] = static_cast<uint8_t>(Protocol::kStatePayloadSize >> 8);
+         frame[2] = static_cast<uint8_t>(Protocol::kStatePayloadSize);
+         std::copy(compactSnapshot.begin(), compactSnapshot.end(), frame.begin() + Protocol::kFrameHeaderSize);
+
+         send(connection, frame.data(), frame.size());
+      }
+      else
+      {
+         Snapshot snapshot;
+         connection.nextSequence = server.copySnapshot(snapshot);
+         send(connection, snapshot.data(), snapshot.size());
+      }
+
+      // Sent after the state, so that a client that loses the connection in between resumes from too early (which is harmless) rather than too late
+      if (connection.sendsSync)
+      {
+         sendSync(connection, Protocol::SyncType::Snapshot);
+      }
+   }
+
+   void Server::Reactor::prepareBatch()
+   {
+      batchStart = std::max(batchEnd, server.eventRing->getOldestSequence());
+      batchEnd = batchStart;
+
+      if (connections.empty())
+      {
+         batches.clear();
+         batchStart = batchEnd = server.eventRing->getNextSequence();
+         return;
+      }
+
+      // Only encode the combinations of format and subscription that some connection is actually using (most clients share just a few)
+      for (Batch& batch : batches)
+      {
+         batch.data.clear();
+         batch.numEvents = 0;
+         batch.inUse = false;
+      }
+
+      for (const std::unique_ptr<Connection>& connection : connections)
+      {
+         if (connection->protocolVersion == 0 || connection->updateInterval > Clock::duration::zero())
+         {
+            continue;
+         }
+
+         Batch* batch = findBatch(connection->eventFormat, connection->subscription);
+         if (!batch)
+         {
+            batches.emplace_back();
+            batch = &batches.back();
+            batch->format = connection->eventFormat;
+            batch->subscription = connection->subscription;
+         }
+         batch->inUse = true;
+      }
+
+      batches.erase(std::remove_if(batches.begin(), batches.end(), [](const Batch& batch) { return !batch.inUse; }), batches.end());
+
+      std::vector<EventWriter> writers;
+      writers.reserve(batches.size());
+      for (Batch& batch : batches)
+      {
+         writers.emplace_back(batch.data, batch.format, batch.subscription);
+      }
+
+      auto isAnyFull = [&writers]()
+      {
+         return std::any_of(writers.begin(), writers.end(), [](const EventWriter& writer) { return writer.isFull(); });
+      };
+
+      EventRing<kEventRingCapacity>::Entry entry;
+      while (!isAnyFull() && server.eventRing->read(batchEnd, entry) == EventRing<kEventRingCapacity>::ReadResult::Success)
+      {
+         for (EventWriter& writer : writers)
+         {
+            writer.add(entry);
+         }
+         ++batchEnd;
+      }
+
+      for (std::size_t i = 0; i < writers.size(); ++i)
+      {
+         writers[i].finish();
+         batches[i].numEvents = writers[i].getNumEvents();
+      }
+   }
+
+   void Server::Reactor::service(Connection& connection, TimePoint now)
+   {
+      if (connection.closed || connection.protocolVersion == 0)
+      {
+         return;
+      }
+
+      if (connection.updateInterval > Clock::duration::zero())
+      {
+         serviceRateLimited(connection, now);
+         return;
+      }
+
+      applyBackpressure(connection);
+
+      // Only encode more events once everything previously encoded has been sent, so that a slow reader's backlog stays in the (shared) ring or its conflated events instead of growing its buffer
+      const std::size_t eventSize = getEventSize(connection.eventFormat);
+      const Batch* batch = findBatch(connection.eventFormat, connection.subscription);
+      const std::size_t maxEventsPerSend = std::max<std::size_t>(server.settings.maxClientBacklogBytes / eventSize, 1);
+      while (!connection.closed && connection.outBuffer.empty())
+      {
+         if (connection.needsResync)
+         {
+            resync(connection);
+         }
+         else if (!connection.conflatedEvents.isEmpty())
+         {
+            // Everything conflated so far goes out first, anything newer is picked up from the ring afterwards
+            EventWriter writer(connection.outBuffer, connection.eventFormat, connection.subscription);
+            connection.conflatedEvents.drain([&writer](const SequencedEvent& event)
+            {
+               writer.add(event);
+            });
+            writer.finish();
+
+            flush(connection);
+         }
+         else if (batch && connection.eventFormat == EventFormat::Packets && connection.subscription == Subscription::kAllControls && connection.nextSequence >= batchStart && connection.nextSequence < batchEnd)
+         {
+            // Every packet is the same size (and unfiltered batches hold every event), so a connection that is part way through the batch can still share it
+            uint64_t sliceEnd = std::min(batchEnd, connection.nextSequence + maxEventsPerSend);
+            std::size_t offset = static_cast<std::size_t>(connection.nextSequence - batchStart) * sizeof(EventPacket);
+            std::size_t size = static_cast<std::size_t>(sliceEnd - connection.nextSequence) * sizeof(EventPacket);
+            connection.nextSequence = sliceEnd;
+
+            send(connection, batch->data.data() + offset, size);
+         }
+         else if (batch && connection.eventFormat != EventFormat::Packets && connection.nextSequence == batchStart && batchEnd > batchStart && batch->numEvents <= maxEventsPerSend)
+         {
+            // Framed batches can only be shared by connections that need all of them (and a batch can be empty if none of the events were subscribed to)
+            connection.nextSequence = batchEnd;
+            if (!batch->data.empty())
+            {
+               send(connection, batch->data.data(), batch->data.size());
+            }
+         }
+         else if (connection.nextSequence < batchEnd)
+         {
+            EventWriter writer(connection.outBuffer, connection.eventFormat, connection.subscription);
+            EventRing<kEventRingCapacity>::Entry entry;
+            EventRing<kEventRingCapacity>::ReadResult result = server.eventRing->read(connection.nextSequence, entry);
+            while (result == EventRing<kEventRingCapacity>::ReadResult::Success)
+            {
+               writer.add(entry);
+               ++connection.nextSequence;
+
+               if (writer.isFull() || connection.outBuffer.size() >= maxEventsPerSend * eventSize)
+               {
+                  break;
+               }
+               result = server.eventRing->read(connection.nextSequence, entry);
+            }
+            writer.finish();
+
+            if (result == EventRing<kEventRingCapacity>::ReadResult::Overrun)
+            {
+               connection.outBuffer.clear();
+               connection.needsResync = true;
+            }
+            else
+            {
+               flush(connection);
+            }
+         }
+         else
+         {
+            break;
+         }
+      }
+   }
+
+   void Server::Reactor::serviceRateLimited(Connection& connection, TimePoint now)
+   {
+      // Everything that changed during the interval goes out together, once the previous update has been fully sent (which also keeps a slow reader's backlog bounded)
+      if (now < connection.nextFlushTime || !connection.outBuffer.empty())
+      {
+         return;
+      }
+
+      if (!connection.needsResync)
+      {
+         conflate(connection);
+      }
+
+      if (connection.needsResync)
+      {
+         resync(connection);
+      }
+      else if (!connection.conflatedEvents.isEmpty())
+      {
+         EventWriter writer(connection.outBuffer, connection.eventFormat, connection.subscription);
+         connection.conflatedEvents.drain([&writer](const SequencedEvent& event)
+         {
+            writer.add(event);
+         });
+         writer.finish();
+
+         flush(connection);
+      }
+      else
+      {
+         // Nothing was sent, so the next change can go out right away
+         return;
+      }
+
+      connection.nextFlushTime = TimePoint((now.time_since_epoch() / connection.updateInterval + 1) * connection.updateInterval);
+   }
+
+   std::optional<Server::TimePoint> Server::Reactor::getNextFlushTime() const
+   {
+      if (numRateLimited == 0)
+      {
+         return std::nullopt;
+      }
+
+      // Only connections that have something to send (and aren't still busy sending the previous update) need to be woken up
+      uint64_t nextSequence = server.eventRing->getNextSequence();
+      std::optional<TimePoint> nextFlushTime;
+      for (const std::unique_ptr<Connection>& connection : connections)
+      {
+         bool hasPendingChanges = connection->nextSequence < nextSequence || !connection->conflatedEvents.isEmpty() || connection->needsResync;
+         if (connection->updateInterval > Clock::duration::zero() && connection->protocolVersion != 0 && connection->outBuffer.empty() && hasPendingChanges)
+         {
+            if (!nextFlushTime.has_value() || connection->nextFlushTime < nextFlushTime.value())
+            {
+               nextFlushTime = connection->nextFlushTime;
+            }
+         }
       }
 
-      bool sendEvents(Sock::Socket socket, moodycamel::ReaderWriterQueue<Server::ButtonEvent>& buttonQueue, moodycamel::ReaderWriterQueue<Server::DialEvent>& dialQueue, moodycamel::ReaderWriterQueue<Server::SliderEvent>& sliderQueue)
+      return nextFlushTime;
+   }
+
+   void Server::Reactor::applyBackpressure(Connection& connection)
+   {
+      if (connection.needsResync)
       {
-         bool success = true;
+         return;
+      }
 
-         Server::ButtonEvent buttonEvent;
-         while (buttonQueue.try_dequeue(buttonEvent))
-         {
-            success = success && sendButtonEvent(socket, buttonEvent);
-         }
+      uint64_t nextSequence = server.eventRing->getNextSequence();
+      uint64_t unreadEvents = nextSequence - std::min(connection.nextSequence, nextSequence);
+      uint64_t bufferedEvents = (connection.outBuffer.size() - connection.outOffset) / getEventSize(connection.eventFormat);
+      uint64_t maxEvents = server.settings.maxClientBacklogEvents;
+      if (unreadEvents + bufferedEvents <= maxEvents)
+      {
+         return;
+      }
 
-         Server::DialEvent dialEvent;
-         while (dialQueue.try_dequeue(dialEvent))
-         {
-            success = success && sendDialEvent(socket, dialEvent);
-         }
+      switch (server.settings.backpressurePolicy)
+      {
+      case BackpressurePolicy::DropOldest:
+      {
+         // Data that has already been handed to the socket can't be taken back, so only unread events are dropped
+         uint64_t eventsToKeep = maxEvents > bufferedEvents ? maxEvents - bufferedEvents : 0;
+         uint64_t newNextSequence = nextSequence - std::min(eventsToKeep, unreadEvents);
 
-         Server::SliderEvent sliderEvent;
-         while (sliderQueue.try_dequeue(sliderEvent))
+         connection.counters->droppedEvents += newNextSequence - connection.nextSequence;
+         connection.nextSequence = newNextSequence;
+         break;
+      }
+      case BackpressurePolicy::Conflate:
+         conflate(connection);
+         break;
+      case BackpressurePolicy::Disconnect:
+         if (server.settings.printErrorMessages)
          {
-            success = success && sendSliderEvent(socket, sliderEvent);
+            fprintf(stderr, "Kontroller::Server - disconnecting %s, which is %llu events behind\n", connection.address.c_str(), static_cast<unsigned long long>(unreadEvents + bufferedEvents));
          }
 
-         return success;
+         ++connection.counters->disconnects;
+         connection.closed = true;
+         break;
       }
+   }
 
-      bool sendInitialEvents(Sock::Socket socket, const State& state)
-      {
-         std::vector<Server::ButtonEvent> buttonEvents;
-         buttonEvents.reserve(35);
-         buttonEvents.push_back({ Button::TrackPrevious, state.trackPrevious });
-         buttonEvents.push_back({ Button::TrackNext, state.trackNext });
-         buttonEvents.push_back({ Button::Cycle, state.cycle });
-         buttonEvents.push_back({ Button::MarkerSet, state.markerSet });
-         buttonEvents.push_back({ Button::MarkerPrevious, state.markerPrevious });
-         buttonEvents.push_back({ Button::MarkerNext, state.markerNext });
-         buttonEvents.push_back({ Button::Rewind, state.rewind });
-         buttonEvents.push_back({ Button::FastForward, state.fastForward });
-         buttonEvents.push_back({ Button::Stop, state.stop });
-         buttonEvents.push_back({ Button::Play, state.play });
-         buttonEvents.push_back({ Button::Record, state.record });
-         buttonEvents.push_back({ Button::Group1Solo, state.groups[0].solo });
-         buttonEvents.push_back({ Button::Group1Mute, state.groups[0].mute });
-         buttonEvents.push_back({ Button::Group1Record, state.groups[0].record });
-         buttonEvents.push_back({ Button::Group2Solo, state.groups[1].solo });
-         buttonEvents.push_back({ Button::Group2Mute, state.groups[1].mute });
-         buttonEvents.push_back({ Button::Group2Record, state.groups[1].record });
-         buttonEvents.push_back({ Button::Group3Solo, state.groups[2].solo });
-         buttonEvents.push_back({ Button::Group3Mute, state.groups[2].mute });
-         buttonEvents.push_back({ Button::Group3Record, state.groups[2].record });
-         buttonEvents.push_back({ Button::Group4Solo, state.groups[3].solo });
-         buttonEvents.push_back({ Button::Group4Mute, state.groups[3].mute });
-         buttonEvents.push_back({ Button::Group4Record, state.groups[3].record });
-         buttonEvents.push_back({ Button::Group5Solo, state.groups[4].solo });
-         buttonEvents.push_back({ Button::Group5Mute, state.groups[4].mute });
-         buttonEvents.push_back({ Button::Group5Record, state.groups[4].record });
-         buttonEvents.push_back({ Button::Group6Solo, state.groups[5].solo });
-         buttonEvents.push_back({ Button::Group6Mute, state.groups[5].mute });
-         buttonEvents.push_back({ Button::Group6Record, state.groups[5].record });
-         buttonEvents.push_back({ Button::Group7Solo, state.groups[6].solo });
-         buttonEvents.push_back({ Button::Group7Mute, state.groups[6].mute });
-         buttonEvents.push_back({ Button::Group7Record, state.groups[6].record });
-         buttonEvents.push_back({ Button::Group8Solo, state.groups[7].solo });
-         buttonEvents.push_back({ Button::Group8Mute, state.groups[7].mute });
-         buttonEvents.push_back({ Button::Group8Record, state.groups[7].record });
-
-         std::vector<Server::DialEvent> dialEvents;
-         dialEvents.reserve(8);
-         dialEvents.push_back({ Dial::Group1, state.groups[0].dial });
-         dialEvents.push_back({ Dial::Group2, state.groups[1].dial });
-         dialEvents.push_back({ Dial::Group3, state.groups[2].dial });
-         dialEvents.push_back({ Dial::Group4, state.groups[3].dial });
-         dialEvents.push_back({ Dial::Group5, state.groups[4].dial });
-         dialEvents.push_back({ Dial::Group6, state.groups[5].dial });
-         dialEvents.push_back({ Dial::Group7, state.groups[6].dial });
-         dialEvents.push_back({ Dial::Group8, state.groups[7].dial });
-
-         std::vector<Server::SliderEvent> sliderEvents;
-         sliderEvents.reserve(8);
-         sliderEvents.push_back({ Slider::Group1, state.groups[0].slider });
-         sliderEvents.push_back({ Slider::Group2, state.groups[1].slider });
-         sliderEvents.push_back({ Slider::Group3, state.groups[2].slider });
-         sliderEvents.push_back({ Slider::Group4, state.groups[3].slider });
-         sliderEvents.push_back({ Slider::Group5, state.groups[4].slider });
-         sliderEvents.push_back({ Slider::Group6, state.groups[5].slider });
-         sliderEvents.push_back({ Slider::Group7, state.groups[6].slider });
-         sliderEvents.push_back({ Slider::Group8, state.groups[7].slider });
+   void Server::Reactor::resync(Connection& connection)
+   {
+      // The connection fell so far behind that events it needed have been overwritten, so resynchronize it with the current state
+      connection.conflatedEvents.clear();
+      connection.needsResync = false;
+      ++connection.counters->resyncs;
 
-         bool success = true;
+      sendState(connection);
+   }
 
-         for (const Server::ButtonEvent& buttonEvent : buttonEvents)
+   void Server::Reactor::conflate(Connection& connection)
+   {
+      // Catch up with the ring even though the socket can't, so that the connection's backlog never grows past one value per control
+      EventRing<kEventRingCapacity>::Entry entry;
+      EventRing<kEventRingCapacity>::ReadResult result = server.eventRing->read(connection.nextSequence, entry);
+      while (result == EventRing<kEventRingCapacity>::ReadResult::Success)
+      {
+         // Rate limited connections leave any button events that don't fit in the queue for the next update, rather than collapsing them
+         if (connection.updateInterval > Clock::duration::zero() && connection.conflatedEvents.isButtonQueueFull())
          {
-            success = success && sendButtonEvent(socket, buttonEvent);
+            break;
          }
 
-         for (const Server::DialEvent& dialEvent : dialEvents)
+         std::optional<uint8_t> index = Protocol::getControlIndex(entry.packet);
+         if (index.has_value() && (connection.subscription & (1ull << index.value())))
          {
-            success = success && sendDialEvent(socket, dialEvent);
+            connection.counters->conflatedEvents += connection.conflatedEvents.add(entry);
          }
+         ++connection.nextSequence;
 
-         for (const Server::SliderEvent& sliderEvent : sliderEvents)
-         {
-            success = success && sendSliderEvent(socket, sliderEvent);
-         }
+         result = server.eventRing->read(connection.nextSequence, entry);
+      }
 
-         return success;
+      if (result == EventRing<kEventRingCapacity>::ReadResult::Overrun)
+      {
+         connection.needsResync = true;
       }
+   }
 
-      std::optional<Kontroller::State> loadStateFromFile(const std::optional<std::filesystem::path>& path)
+   void Server::Reactor::send(Connection& connection, const uint8_t* data, std::size_t size)
+   {
+      if (connection.outBuffer.empty())
       {
-         if (!path.has_value())
+         // Try to hand the data straight to the socket, and only copy whatever it won't take
+         std::size_t bytesSent = sendNow(connection, data, size);
+         if (!connection.closed && bytesSent < size)
          {
-            return std::nullopt;
+            connection.outBuffer.assign(data + bytesSent, data + size);
+            connection.outOffset = 0;
          }
 
-         std::optional<std::string> text = IOUtils::readTextFile(path.value());
-         if (!text.has_value())
-         {
-            return std::nullopt;
-         }
+         updateWriteInterest(connection);
+      }
+      else
+      {
+         connection.outBuffer.insert(connection.outBuffer.end(), data, data + size);
+         flush(connection);
+      }
+   }
 
-         std::stringstream ss(text.value());
+   void Server::Reactor::flush(Connection& connection)
+   {
+      connection.outOffset += sendNow(connection, connection.outBuffer.data() + connection.outOffset, connection.outBuffer.size() - connection.outOffset);
 
-         Kontroller::State state;
-         for (Kontroller::Group& group : state.groups)
-         {
-            ss >> group.dial;
-            if (ss.fail())
-            {
-               return std::nullopt;
-            }
+      if (connection.outOffset == connection.outBuffer.size())
+      {
+         connection.outBuffer.clear();
+         connection.outOffset = 0;
+      }
 
-            ss >> group.slider;
-            if (ss.fail())
+      updateWriteInterest(connection);
+   }
+
+   std::size_t Server::Reactor::sendNow(Connection& connection, const uint8_t* data, std::size_t size)
+   {
+      std::size_t bytesSent = 0;
+      while (!connection.closed && bytesSent < size)
+      {
+         Sock::SignedResult result = Sock::send(connection.socket, data + bytesSent, static_cast<Sock::Length>(size - bytesSent), kSendFlags);
+         if (result == Sock::kSocketError)
+         {
+            if (Sock::System::getLastError() != Sock::WouldBlock)
             {
-               return std::nullopt;
+               // Connection lost
+               connection.closed = true;
             }
+            break;
          }
 
-         return state;
+         bytesSent += result;
       }
 
-      bool saveStateToFile(const Kontroller::State& state, const std::optional<std::filesystem::path>& path)
+      if (bytesSent > 0 && connection.heartbeats)
       {
-         if (!path.has_value())
-         {
-            return false;
-         }
+         connection.lastSendTime = Clock::now();
+      }
 
-         std::stringstream ss;
-         ss.precision(std::numeric_limits<double>::digits10 + 1);
+      return bytesSent;
+   }
 
-         for (const Kontroller::Group& group : state.groups)
+   void Server::Reactor::updateWriteInterest(Connection& connection)
+   {
+      // Only ask to be notified about writability while there is data that the socket could not accept
+      bool shouldWaitForWrite = !connection.closed && !connection.outBuffer.empty();
+      if (shouldWaitForWrite != connection.waitingForWrite)
+      {
+         uint32_t flags = Poller::Readable;
+         if (shouldWaitForWrite)
          {
-            ss << group.dial << "\n" << group.slider << "\n\n";
+            flags |= Poller::Writable;
          }
 
-         return IOUtils::writeTextFile(path.value(), ss.str());
+         poller.modify(connection.socket, flags, &connection);
+         connection.waitingForWrite = shouldWaitForWrite;
       }
    }
 
    Server::Server(const Settings& serverSettings)
       : settings(serverSettings)
       , stateFilePath(serverSettings.filePathOverride.has_value() ? serverSettings.filePathOverride : IOUtils::getAbsoluteCommonAppDataPath("Kontroller", "state.txt"))
+      , epoch(makeEpoch())
+      , eventRing(std::make_unique<EventRing<kEventRingCapacity>>())
    {
       if (settings.serializeStateToFile)
       {
@@ -356,7 +1753,34 @@ namespace Kontroller
          }
       }
 
-      listenThread = std::thread([this]() { run(); });
+      encodeSnapshot(snapshot.data(), compactSnapshot.data(), state);
+
+      if (settings.sharedStateName.has_value())
+      {
+         sharedStateBlock = createSharedBlock<SharedStateBlock>(sharedState, settings.sharedStateName.value(), settings.printErrorMessages);
+         if (sharedStateBlock)
+         {
+            sharedStateBlock->lock.beginWrite();
+            forEachControlPacket(state, [this](const EventPacket& packet)
+            {
+               updateSharedState(*sharedStateBlock, packet, snapshotSequence);
+            });
+            sharedStateBlock->lock.endWrite();
+
+            sharedStateBlock->magic.store(SharedStateBlock::kMagic, std::memory_order_release);
+         }
+      }
+
+      if (settings.sharedEventsName.has_value())
+      {
+         sharedEventBlock = createSharedBlock<SharedEventBlock>(sharedEvents, settings.sharedEventsName.value(), settings.printErrorMessages);
+         if (sharedEventBlock)
+         {
+            sharedEventBlock->magic.store(SharedEventBlock::kMagic, std::memory_order_release);
+         }
+      }
+
+      thread = std::thread([this]() { run(); });
    }
 
    Server::~Server()
@@ -364,9 +1788,24 @@ namespace Kontroller
       {
          std::lock_guard<std::mutex> lock(shutDownMutex);
          shuttingDown.store(true);
+
+         for (std::unique_ptr<Reactor>& reactor : reactors)
+         {
+            reactor->poller.wake();
+         }
       }
       cv.notify_all();
-      listenThread.join();
+      thread.join();
+
+      // Let readers know that the blocks are no longer being updated
+      if (sharedStateBlock)
+      {
+         sharedStateBlock->magic.store(0, std::memory_order_release);
+      }
+      if (sharedEventBlock)
+      {
+         sharedEventBlock->magic.store(0, std::memory_order_release);
+      }
    }
 
    Kontroller::State Server::getState() const
@@ -375,6 +1814,45 @@ namespace Kontroller
       return state;
    }
 
+   std::vector<Server::ClientStats> Server::getClientStats() const
+   {
+      std::lock_guard<std::mutex> lock(connectionsMutex);
+
+      std::vector<ClientStats> stats;
+      stats.reserve(clientCounters.size());
+      for (const auto& pair : clientCounters)
+      {
+         ClientStats clientStats;
+         clientStats.address = pair.first;
+         clientStats.numConnections = pair.second.numConnections.load();
+         clientStats.droppedEvents = pair.second.droppedEvents.load();
+         clientStats.conflatedEvents = pair.second.conflatedEvents.load();
+         clientStats.resyncs = pair.second.resyncs.load();
+         clientStats.disconnects = pair.second.disconnects.load();
+         clientStats.idleTimeouts = pair.second.idleTimeouts.load();
+         clientStats.resumes = pair.second.resumes.load();
+         clientStats.lateHellos = pair.second.lateHellos.load();
+
+         stats.push_back(clientStats);
+      }
+
+      return stats;
+   }
+
+   uint64_t Server::copySnapshot(Snapshot& destination) const
+   {
+      std::lock_guard<std::mutex> lock(stateMutex);
+      destination = snapshot;
+      return snapshotSequence + 1;
+   }
+
+   uint64_t Server::copySnapshot(CompactSnapshot& destination) const
+   {
+      std::lock_guard<std::mutex> lock(stateMutex);
+      destination = compactSnapshot;
+      return snapshotSequence + 1;
+   }
+
    void Server::run()
    {
       int initializeResult = -1;
@@ -397,258 +1875,338 @@ namespace Kontroller
          }
       }
 
+      {
+         std::lock_guard<std::mutex> lock(shutDownMutex);
+         if (!shuttingDown.load())
+         {
+            int numReactors = std::max(settings.numIOThreads, 1);
+            for (int i = 0; i < numReactors; ++i)
+            {
+               reactors.push_back(std::make_unique<Reactor>(*this));
+            }
+         }
+      }
+
       if (!shuttingDown.load())
       {
          Device device;
          device.setState(getState());
          setCallbacks(device);
 
-         while (!shuttingDown.load())
+         // The first reactor runs on this thread (and also owns the listen socket), the rest get threads of their own
+         for (std::size_t i = 1; i < reactors.size(); ++i)
          {
-            listen();
+            Reactor* reactor = reactors[i].get();
+            reactor->thread = std::thread([this, reactor]() { runReactor(*reactor, false); });
          }
-      }
 
-      {
-         std::unique_lock<std::mutex> lock(threadDataMutex);
+         runReactor(*reactors[0], true);
 
-         while (!threadData.empty())
+         for (std::unique_ptr<Reactor>& reactor : reactors)
          {
-            for (std::unique_ptr<ThreadData>& data : threadData)
+            if (reactor->thread.joinable())
             {
-               data->cv.notify_all();
-            }
-
-            {
-               lock.unlock();
-               pruneThreads();
-               lock.lock();
+               reactor->thread.join();
             }
          }
       }
 
+      {
+         std::lock_guard<std::mutex> lock(shutDownMutex);
+         reactors.clear();
+      }
+
       if (initializeResult == 0)
       {
          Sock::System::terminate();
       }
    }
 
-   void Server::listen()
+   void Server::runReactor(Reactor& reactor, bool primary)
    {
-      Sock::Socket listenSocket = Sock::kInvalidSocket;
-      while (listenSocket == Sock::kInvalidSocket && !shuttingDown.load())
+      if (!reactor.poller.isValid())
       {
-         listenSocket = createListenSocket(settings.printErrorMessages);
-
-         if (listenSocket == Sock::kInvalidSocket)
+         if (settings.printErrorMessages)
          {
-            std::unique_lock<std::mutex> lock(shutDownMutex);
-            cv.wait_for(lock, std::chrono::milliseconds(settings.retryMilliseconds), [this]
-            {
-               return shuttingDown.load();
-            });
+            fprintf(stderr, "Kontroller::Server - unable to create poller, error: %d\n", Sock::System::getLastError());
          }
+         return;
       }
 
-      if (listenSocket != Sock::kInvalidSocket)
+      // TCP for remote clients, and a unix domain socket for local ones
+      struct Listener
       {
-         listening.store(true);
-      }
+         Sock::Socket socket = Sock::kInvalidSocket;
+         TimePoint nextListenTime;
+      };
+      std::array<Listener, 2> listeners;
+      Listener& tcpListener = listeners[0];
+      Listener& unixListener = listeners[1];
 
-      while (!shuttingDown.load())
+      auto closeListener = [this](Sock::Socket& socket, bool unixDomain)
       {
-         // Wait until there is a socket ready to be accepted
-         Sock::Result pollResult = Sock::Helpers::poll(listenSocket, POLLRDNORM, settings.timeoutMilliseconds, "Kontroller::Server", settings.printErrorMessages);
+         if (socket == Sock::kInvalidSocket)
+         {
+            return;
+         }
+
+         Sock::shutdown(socket, Sock::ShutdownMethod::ReadWrite);
+         Sock::close(socket);
+         socket = Sock::kInvalidSocket;
 
-         if (pollResult == Sock::Result::Success && !shuttingDown.load())
+         // Only remove the socket file once it has definitely been bound by us
+         if (unixDomain && settings.unixSocketPath.has_value())
          {
-            Sock::Socket clientSocket = Sock::accept(listenSocket, nullptr, nullptr);
-            if (clientSocket != Sock::kInvalidSocket)
-            {
-               std::lock_guard<std::mutex> lock(threadDataMutex);
+            std::error_code errorCode;
+            std::filesystem::remove(settings.unixSocketPath.value(), errorCode);
+         }
+      };
 
-               ThreadData* data = threadData.emplace_back(std::make_unique<ThreadData>()).get();
-               data->encodedSocket = encodeSocket(clientSocket);
-               data->thread = std::thread([this, data]() { manageConnection(data); });
-            }
-            else
+      std::array<Poller::Event, kMaxEventsPerWait> events;
+      while (!shuttingDown.load())
+      {
+         // The primary reactor wakes up periodically to handle the listen sockets and the state file, the others only when there is something to do
+         int timeoutMS = primary ? settings.timeoutMilliseconds : -1;
+         if (primary)
+         {
+            for (Listener& listener : listeners)
             {
-               if (settings.printErrorMessages)
+               if (listener.socket != Sock::kInvalidSocket || Clock::now() < listener.nextListenTime)
                {
-                  fprintf(stderr, "Kontroller::Server - accept failed with error: %d\n", Sock::System::getLastError());
+                  continue;
+               }
+
+               if (&listener == &tcpListener)
+               {
+                  listener.socket = createListenSocket(settings.printErrorMessages);
+               }
+               else if (settings.unixSocketPath.has_value() && SOCK_UNIX_DOMAIN)
+               {
+                  listener.socket = createUnixListenSocket(settings.unixSocketPath.value(), settings.printErrorMessages);
+               }
+               else
+               {
+                  listener.nextListenTime = TimePoint::max();
+                  continue;
+               }
+
+               if (listener.socket == Sock::kInvalidSocket || !reactor.poller.add(listener.socket, Poller::Readable, &listener))
+               {
+                  closeListener(listener.socket, &listener == &unixListener);
+                  listener.nextListenTime = Clock::now() + std::chrono::milliseconds(settings.retryMilliseconds);
                }
-               break;
             }
-         }
-         else if (pollResult == Sock::Result::Error)
-         {
-            break;
-         }
 
-         pruneThreads();
+            listening.store(tcpListener.socket != Sock::kInvalidSocket || unixListener.socket != Sock::kInvalidSocket);
 
-         if (settings.serializeStateToFile && stateFilePath.has_value())
-         {
-            TimePoint stateUpdateTime = lastStateUpdateTime.load();
-            if (lastFileUpdateTime < stateUpdateTime)
+            if (settings.serializeStateToFile && stateFilePath.has_value())
             {
-               TimePoint now = Clock().now();
-               if (now - stateUpdateTime > std::chrono::seconds(1))
+               TimePoint stateUpdateTime = lastStateUpdateTime.load();
+               if (lastFileUpdateTime < stateUpdateTime)
                {
-                  saveStateToFile(getState(), stateFilePath);
-                  lastFileUpdateTime = now;
+                  TimePoint now = Clock().now();
+                  if (now - stateUpdateTime > std::chrono::seconds(1))
+                  {
+                     saveStateToFile(getState(), stateFilePath);
+                     lastFileUpdateTime = now;
+                  }
                }
             }
          }
-      }
 
-      listening.store(false);
+         // New events that arrive shortly after the last batch wait for the coalescing window to end, so that bursts go out together
+         TimePoint batchTime = reactor.lastBatchTime + std::chrono::milliseconds(settings.coalesceMilliseconds);
+         if (eventRing->getNextSequence() != reactor.batchEnd)
+         {
+            TimePoint now = Clock::now();
+            int batchTimeoutMS = now >= batchTime ? 0 : static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(batchTime - now).count()) + 1;
+            timeoutMS = timeoutMS < 0 ? batchTimeoutMS : std::min(timeoutMS, batchTimeoutMS);
+         }
 
-      if (listenSocket != Sock::kInvalidSocket)
-      {
-         Sock::shutdown(listenSocket, Sock::ShutdownMethod::ReadWrite);
-         Sock::close(listenSocket);
-      }
-   }
+         // Connections that haven't said hello yet switch to version 1 once their deadline passes
+         if (std::optional<TimePoint> helloDeadline = reactor.getNextHelloDeadline())
+         {
+            TimePoint now = Clock::now();
+            int helloTimeoutMS = now >= helloDeadline.value() ? 0 : static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(helloDeadline.value() - now).count()) + 1;
+            timeoutMS = timeoutMS < 0 ? helloTimeoutMS : std::min(timeoutMS, helloTimeoutMS);
+         }
 
-   void Server::manageConnection(ThreadData* data)
-   {
-      assert(data != nullptr);
+         // Rate limited connections with pending changes are flushed at their next interval boundary
+         if (std::optional<TimePoint> flushTime = reactor.getNextFlushTime())
+         {
+            TimePoint now = Clock::now();
+            int flushTimeoutMS = now >= flushTime.value() ? 0 : static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(flushTime.value() - now).count()) + 1;
+            timeoutMS = timeoutMS < 0 ? flushTimeoutMS : std::min(timeoutMS, flushTimeoutMS);
+         }
 
-      Sock::Socket socket = decodeSocket(data->encodedSocket);
+         // Heartbeats are sent and idle connections closed on a fixed period
+         if (std::optional<TimePoint> heartbeatTime = reactor.getNextHeartbeatTime())
+         {
+            TimePoint now = Clock::now();
+            int heartbeatTimeoutMS = now >= heartbeatTime.value() ? 0 : static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(heartbeatTime.value() - now).count()) + 1;
+            timeoutMS = timeoutMS < 0 ? heartbeatTimeoutMS : std::min(timeoutMS, heartbeatTimeoutMS);
+         }
 
-      int tcpNoDelay = 1;
-      int optResult = Sock::setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &tcpNoDelay, sizeof(tcpNoDelay));
-      if (optResult == Sock::kSocketError && settings.printErrorMessages)
-      {
-         fprintf(stderr, "Kontroller::Server - unable to disable the Nagle algorithm, connection may be jittery!\n");
-      }
+         int numEvents = reactor.poller.wait(events.data(), static_cast<int>(events.size()), timeoutMS);
+         if (numEvents < 0)
+         {
+            if (settings.printErrorMessages)
+            {
+               fprintf(stderr, "Kontroller::Server - poll failed with error: %d\n", Sock::System::getLastError());
+            }
 
-      if (sendInitialEvents(socket, getState()))
-      {
-         while (!shuttingDown.load())
+            std::unique_lock<std::mutex> lock(shutDownMutex);
+            cv.wait_for(lock, std::chrono::milliseconds(settings.retryMilliseconds), [this]
+            {
+               return shuttingDown.load();
+            });
+            continue;
+         }
+
+         for (int i = 0; i < numEvents; ++i)
          {
+            const Poller::Event& event = events[i];
+
+            if (event.userData == &tcpListener || event.userData == &unixListener)
             {
-               std::unique_lock<std::mutex> lock(data->eventMutex);
-               data->cv.wait(lock, [this, data]()
+               Listener& listener = *static_cast<Listener*>(event.userData);
+               if (event.flags & Poller::Closed)
                {
-                  return data->eventPending.load() || shuttingDown.load();
-               });
+                  reactor.poller.remove(listener.socket);
+                  closeListener(listener.socket, &listener == &unixListener);
+                  listening.store(tcpListener.socket != Sock::kInvalidSocket || unixListener.socket != Sock::kInvalidSocket);
+                  continue;
+               }
 
-               data->eventPending.store(false);
-            }
+               // Accept everything that is pending, handing each new connection to the least busy reactor
+               Sock::Socket clientSocket = Sock::accept(listener.socket, nullptr, nullptr);
+               while (clientSocket != Sock::kInvalidSocket)
+               {
+                  Reactor* target = &reactor;
+                  for (std::unique_ptr<Reactor>& other : reactors)
+                  {
+                     if (other->numConnections.load() < target->numConnections.load())
+                     {
+                        target = other.get();
+                     }
+                  }
+
+                  if (target == &reactor)
+                  {
+                     reactor.openConnection(clientSocket);
+                  }
+                  else
+                  {
+                     target->queueIncoming(clientSocket);
+                  }
+
+                  clientSocket = Sock::accept(listener.socket, nullptr, nullptr);
+               }
 
-            if (!shuttingDown.load())
-            {
-               bool success = sendEvents(socket, data->buttonQueue, data->dialQueue, data->sliderQueue);
-               if (!success)
+               int error = Sock::System::getLastError();
+               if (error != Sock::WouldBlock && settings.printErrorMessages)
                {
-                  break;
+                  fprintf(stderr, "Kontroller::Server - accept failed with error: %d\n", error);
                }
+               continue;
+            }
+
+            // Anything the client sent before the connection went away is still processed
+            Connection& connection = *static_cast<Connection*>(event.userData);
+            if (event.flags & Poller::Readable)
+            {
+               reactor.receive(connection);
+            }
+            if (event.flags & Poller::Closed)
+            {
+               connection.closed = true;
+            }
+            if (event.flags & Poller::Writable)
+            {
+               reactor.flush(connection);
             }
          }
-      }
 
-      Sock::shutdown(socket, Sock::ShutdownMethod::ReadWrite);
-      Sock::close(socket);
+         reactor.adoptIncoming();
 
-      data->complete.store(true);
-   }
+         // An event that arrives after a quiet period is encoded and sent right away
+         TimePoint now = Clock::now();
+         reactor.checkHelloDeadlines(now);
+         reactor.checkHeartbeats(now);
+         if (eventRing->getNextSequence() != reactor.batchEnd && now >= batchTime)
+         {
+            reactor.prepareBatch();
+            reactor.lastBatchTime = now;
+         }
 
-   void Server::pruneThreads()
-   {
-      std::unique_lock<std::mutex> lock(threadDataMutex);
+         for (std::unique_ptr<Connection>& connection : reactor.connections)
+         {
+            reactor.service(*connection, now);
+         }
 
-      for (const std::unique_ptr<ThreadData>& data : threadData)
+         reactor.removeClosedConnections();
+      }
+
+      reactor.closeAllConnections();
+
+      listening.store(false);
+      for (Listener& listener : listeners)
       {
-         if (data->complete.load() && data->thread.joinable())
+         if (listener.socket != Sock::kInvalidSocket)
          {
-            data->thread.join();
+            reactor.poller.remove(listener.socket);
+            closeListener(listener.socket, &listener == &unixListener);
          }
       }
-
-      threadData.erase(std::remove_if(threadData.begin(), threadData.end(), [](const std::unique_ptr<ThreadData>& data) { return data->complete.load() && !data->thread.joinable(); }), threadData.end());
    }
 
    void Server::setCallbacks(Device& device)
    {
-      device.setButtonCallback([this, &device](Button button, bool pressed)
+      // The event callback carries the time at which the device's data was read, which is passed along to clients
+      device.setEventCallback([this, &device](const Event& event)
       {
-         updateState(device);
-
-         ButtonEvent buttonEvent;
-         buttonEvent.button = button;
-         buttonEvent.pressed = pressed;
-
-         {
-            std::lock_guard<std::mutex> lock(threadDataMutex);
-            for (std::unique_ptr<ThreadData>& data : threadData)
-            {
-               data->buttonQueue.enqueue(buttonEvent);
-
-               {
-                  std::lock_guard<std::mutex> eventLock(data->eventMutex);
-                  data->eventPending.store(true);
-               }
-
-               data->cv.notify_all();
-            }
-         }
+         publishEvent(device, makePacket(event), toTimestamp(event.timestamp));
       });
+   }
 
-      device.setDialCallback([this, &device](Dial dial, float value)
+   void Server::publishEvent(Device& device, const EventPacket& packet, uint64_t timestamp)
+   {
+      uint64_t sequence = 0;
       {
-         updateState(device);
+         std::lock_guard<std::mutex> lock(stateMutex);
+         state = device.getState();
+         lastStateUpdateTime.store(Clock().now());
 
-         DialEvent dialEvent;
-         dialEvent.dial = dial;
-         dialEvent.value = value;
+         // Published while holding the state mutex, so that the snapshot and the ring's sequence number are always consistent with each other
+         updateSnapshot(snapshot.data(), compactSnapshot.data(), packet);
+         snapshotSequence = eventRing->publish(packet, timestamp);
+         sequence = snapshotSequence;
 
+         if (sharedStateBlock)
          {
-            std::lock_guard<std::mutex> lock(threadDataMutex);
-            for (std::unique_ptr<ThreadData>& data : threadData)
-            {
-               data->dialQueue.enqueue(dialEvent);
-
-               {
-                  std::lock_guard<std::mutex> eventLock(data->eventMutex);
-                  data->eventPending.store(true);
-               }
+            sharedStateBlock->lock.beginWrite();
+            updateSharedState(*sharedStateBlock, packet, snapshotSequence);
+            sharedStateBlock->lock.endWrite();
+         }
 
-               data->cv.notify_all();
-            }
+         // Both rings see the same events in the same order, so sequence numbers match between them
+         if (sharedEventBlock)
+         {
+            sharedEventBlock->ring.publish(packet, timestamp);
          }
-      });
+      }
 
-      device.setSliderCallback([this, &device](Slider slider, float value)
+      // Reactors whose connections aren't subscribed to the event are left alone, but still woken up every so often so that they don't fall so far behind that their connections run into backpressure limits
+      std::optional<uint8_t> index = Protocol::getControlIndex(packet);
+      uint64_t bit = index.has_value() ? 1ull << index.value() : 0;
+      uint64_t maxUnwokenEvents = std::min<uint64_t>(kEventRingCapacity, std::max<uint64_t>(settings.maxClientBacklogEvents, 2)) / 2;
+      for (std::unique_ptr<Reactor>& reactor : reactors)
       {
-         updateState(device);
-
-         SliderEvent sliderEvent;
-         sliderEvent.slider = slider;
-         sliderEvent.value = value;
-
+         if (reactor->numConnections.load() > 0 && ((reactor->subscriptions.load() & bit) != 0 || sequence - reactor->lastWakeSequence >= maxUnwokenEvents))
          {
-            std::lock_guard<std::mutex> lock(threadDataMutex);
-            for (std::unique_ptr<ThreadData>& data : threadData)
-            {
-               data->sliderQueue.enqueue(sliderEvent);
-
-               {
-                  std::lock_guard<std::mutex> eventLock(data->eventMutex);
-                  data->eventPending.store(true);
-               }
-
-               data->cv.notify_all();
-            }
+            reactor->lastWakeSequence = sequence;
+            reactor->poller.wake();
          }
-      });
-   }
-
-   void Server::updateState(Device& device)
-   {
-      std::lock_guard<std::mutex> lock(stateMutex);
-      state = device.getState();
-      lastStateUpdateTime.store(Clock().now());
+      }
    }
 }
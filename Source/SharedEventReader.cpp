@@ -0,0 +1,106 @@
+#include "Kontroller/SharedState.h"
+
+#include "SharedLayout.h"
+#include "SharedMemory.h"
+
+#include <algorithm>
+
+namespace Kontroller
+{
+   SharedEventReader::SharedEventReader(const char* name /*= kSharedEventsName*/)
+      : name(name)
+   {
+      connect();
+   }
+
+   SharedEventReader::~SharedEventReader() = default;
+
+   bool SharedEventReader::read(EventPacket& packet, uint64_t* sequence /*= nullptr*/, std::chrono::steady_clock::time_point* timestamp /*= nullptr*/)
+   {
+      if (!connect())
+      {
+         return false;
+      }
+
+      EventRing<SharedEventBlock::kCapacity>::Entry entry;
+      while (true)
+      {
+         switch (block->ring.read(nextSequence, entry))
+         {
+         case EventRing<SharedEventBlock::kCapacity>::ReadResult::Success:
+            ++nextSequence;
+
+            packet = entry.packet;
+            if (sequence)
+            {
+               *sequence = entry.sequence;
+            }
+            if (timestamp)
+            {
+               *timestamp = fromTimestamp(entry.timestamp);
+            }
+            return true;
+         case EventRing<SharedEventBlock::kCapacity>::ReadResult::Empty:
+            return false;
+         case EventRing<SharedEventBlock::kCapacity>::ReadResult::Overrun:
+         {
+            // Skip ahead to the oldest event that is still available (or past the one that is currently being overwritten)
+            uint64_t oldestSequence = std::max(block->ring.getOldestSequence(), nextSequence + 1);
+            numMissedEvents += oldestSequence - nextSequence;
+            nextSequence = oldestSequence;
+            break;
+         }
+         }
+      }
+   }
+
+   void SharedEventReader::seek(uint64_t sequence)
+   {
+      nextSequence = sequence;
+      seekPending = block == nullptr;
+   }
+
+   bool SharedEventReader::connect()
+   {
+      if (block && block->magic.load(std::memory_order_acquire) == SharedEventBlock::kMagic)
+      {
+         std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+         if (now < nextReplacementCheck)
+         {
+            return true;
+         }
+
+         nextReplacementCheck = now + kSharedBlockCheckInterval;
+         if (!memory->wasReplaced())
+         {
+            return true;
+         }
+      }
+
+      // Either not connected yet, or the server shut down or crashed (in which case a new one may have replaced the block)
+      block = nullptr;
+      memory = std::make_unique<SharedMemory>(name, sizeof(SharedEventBlock), SharedMemory::Mode::OpenReadOnly);
+      if (!memory->isValid())
+      {
+         memory.reset();
+         return false;
+      }
+
+      const SharedEventBlock* newBlock = static_cast<const SharedEventBlock*>(memory->getData());
+      if (newBlock->magic.load(std::memory_order_acquire) != SharedEventBlock::kMagic || newBlock->version != SharedEventBlock::kVersion)
+      {
+         memory.reset();
+         return false;
+      }
+
+      block = newBlock;
+      nextReplacementCheck = std::chrono::steady_clock::now() + kSharedBlockCheckInterval;
+      if (!seekPending)
+      {
+         nextSequence = block->ring.getNextSequence();
+      }
+      seekPending = false;
+
+      return true;
+   }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "Kontroller/State.h"
+
+#include "EventRing.h"
+#include "SeqLock.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace Kontroller
+{
+   // How often readers check whether their block has been replaced (a server that crashes never clears its magic, so readers can't tell from the block itself)
+   constexpr std::chrono::milliseconds kSharedBlockCheckInterval(1000);
+
+   // Layout of the shared memory block that a Server publishes its state into (see SharedStateReader)
+   // Must stay the same between servers and readers, so bump the version whenever it changes
+   struct SharedStateBlock
+   {
+      static constexpr uint32_t kMagic = 0x4B4E5354; // "KNST"
+      static constexpr uint32_t kVersion = 1;
+
+      // One word per control (buttons, then dials, then sliders, each holding the same value as the control's EventPacket), then the sequence number of the last event included (low word first)
+      static constexpr std::size_t kSequenceWord = kNumControls;
+      static constexpr std::size_t kNumWords = kNumControls + 2;
+
+      // Set once the block has been filled in, and cleared when the server shuts down
+      std::atomic<uint32_t> magic = { 0 };
+      uint32_t version = kVersion;
+
+      SeqLock<kNumWords> lock;
+   };
+
+   // Layout of the shared memory block that a Server publishes every event into (see SharedEventReader)
+   // Events are published in the same order, and with the same sequence numbers, as the server's own event ring
+   struct SharedEventBlock
+   {
+      static constexpr uint32_t kMagic = 0x4B4E5345; // "KNSE"
+      static constexpr uint32_t kVersion = 2;
+      static constexpr std::size_t kCapacity = 65536;
+
+      // Set once the block has been initialized, and cleared when the server shuts down
+      std::atomic<uint32_t> magic = { 0 };
+      uint32_t version = kVersion;
+
+      EventRing<kCapacity> ring;
+   };
+}
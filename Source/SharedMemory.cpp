@@ -0,0 +1,162 @@
+#include "SharedMemory.h"
+
+#include <cstdint>
+
+#if defined(_WIN32)
+#  define SHARED_MEMORY_WINDOWS 1
+#  define SHARED_MEMORY_POSIX 0
+#else
+#  define SHARED_MEMORY_WINDOWS 0
+#  define SHARED_MEMORY_POSIX 1
+#endif
+
+#if SHARED_MEMORY_WINDOWS
+#  include <Windows.h>
+#elif SHARED_MEMORY_POSIX
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+namespace Kontroller
+{
+#if SHARED_MEMORY_WINDOWS
+   struct SharedMemory::ImplData
+   {
+      HANDLE mapping = nullptr;
+   };
+
+   SharedMemory::SharedMemory(const std::string& name, std::size_t blockSize, Mode mode)
+      : implData(std::make_unique<ImplData>())
+   {
+      // Backslashes aren't allowed in mapping names, and the "Local\" prefix keeps the mapping within the current session
+      std::string mappingName = "Local\\" + (name.empty() || name[0] != '/' ? name : name.substr(1));
+
+      if (mode == Mode::Create)
+      {
+         uint64_t mappingSize = blockSize;
+         implData->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(mappingSize >> 32), static_cast<DWORD>(mappingSize), mappingName.c_str());
+      }
+      else
+      {
+         implData->mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, mappingName.c_str());
+      }
+
+      if (implData->mapping)
+      {
+         data = MapViewOfFile(implData->mapping, mode == Mode::Create ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, blockSize);
+         if (data)
+         {
+            size = blockSize;
+         }
+      }
+   }
+
+   SharedMemory::~SharedMemory()
+   {
+      // The mapping goes away once every process has closed its handle
+      if (data)
+      {
+         UnmapViewOfFile(data);
+      }
+      if (implData->mapping)
+      {
+         CloseHandle(implData->mapping);
+      }
+   }
+
+   bool SharedMemory::wasReplaced() const
+   {
+      // The mapping stays alive as long as anyone has it open, so a new server always gets the same one
+      return false;
+   }
+#elif SHARED_MEMORY_POSIX
+   struct SharedMemory::ImplData
+   {
+      std::string name;
+      bool owner = false;
+
+      // Identifies the block that was opened, to tell whether the name still refers to it
+      dev_t device = 0;
+      ino_t inode = 0;
+   };
+
+   SharedMemory::SharedMemory(const std::string& name, std::size_t blockSize, Mode mode)
+      : implData(std::make_unique<ImplData>())
+   {
+      implData->name = name;
+
+      int descriptor = -1;
+      if (mode == Mode::Create)
+      {
+         // Start from scratch, so that readers of a previous block (e.g. from a server that crashed) don't see a mix of old and new data
+         shm_unlink(name.c_str());
+         descriptor = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+         if (descriptor != -1 && ftruncate(descriptor, static_cast<off_t>(blockSize)) != 0)
+         {
+            close(descriptor);
+            shm_unlink(name.c_str());
+            descriptor = -1;
+         }
+         implData->owner = descriptor != -1;
+      }
+      else
+      {
+         descriptor = shm_open(name.c_str(), O_RDONLY, 0);
+
+         // A block that is still being created may not have its final size yet
+         struct stat status = {};
+         if (descriptor != -1 && (fstat(descriptor, &status) != 0 || static_cast<std::size_t>(status.st_size) < blockSize))
+         {
+            close(descriptor);
+            descriptor = -1;
+         }
+
+         implData->device = status.st_dev;
+         implData->inode = status.st_ino;
+      }
+
+      if (descriptor == -1)
+      {
+         return;
+      }
+
+      void* mappedData = mmap(nullptr, blockSize, mode == Mode::Create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, descriptor, 0);
+      close(descriptor);
+
+      if (mappedData != MAP_FAILED)
+      {
+         data = mappedData;
+         size = blockSize;
+      }
+   }
+
+   SharedMemory::~SharedMemory()
+   {
+      if (data)
+      {
+         munmap(data, size);
+      }
+      if (implData->owner)
+      {
+         shm_unlink(implData->name.c_str());
+      }
+   }
+
+   bool SharedMemory::wasReplaced() const
+   {
+      int descriptor = shm_open(implData->name.c_str(), O_RDONLY, 0);
+      if (descriptor == -1)
+      {
+         return true;
+      }
+
+      struct stat status = {};
+      bool replaced = fstat(descriptor, &status) != 0 || status.st_dev != implData->device || status.st_ino != implData->inode;
+      close(descriptor);
+
+      return replaced;
+   }
+#endif
+}
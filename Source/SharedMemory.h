@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace Kontroller
+{
+   // Named block of memory that can be mapped by multiple processes (POSIX shared memory, or a file mapping on Windows)
+   // Names should start with a slash and contain no others (e.g. "/kontroller-state")
+   class SharedMemory
+   {
+   public:
+      enum class Mode
+      {
+         // Creates the block (replacing any existing one with the same name), which is removed again when this object is destroyed
+         Create,
+
+         // Maps an existing block for reading only
+         OpenReadOnly
+      };
+
+      struct ImplData;
+
+      SharedMemory(const std::string& name, std::size_t size, Mode mode);
+      ~SharedMemory();
+
+      SharedMemory(const SharedMemory& other) = delete;
+      SharedMemory& operator=(const SharedMemory& other) = delete;
+
+      bool isValid() const
+      {
+         return data != nullptr;
+      }
+
+      void* getData() const
+      {
+         return data;
+      }
+
+      std::size_t getSize() const
+      {
+         return size;
+      }
+
+      // Whether the name now refers to a different block than the one that was opened (e.g. one created by a new server after the previous one crashed), or to none at all
+      // Costs a few system calls, so should only be checked occasionally
+      bool wasReplaced() const;
+
+   private:
+      std::unique_ptr<ImplData> implData;
+      void* data = nullptr;
+      std::size_t size = 0;
+   };
+}
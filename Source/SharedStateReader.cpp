@@ -0,0 +1,88 @@
+#include "Kontroller/SharedState.h"
+
+#include "SharedLayout.h"
+#include "SharedMemory.h"
+#include "StateLock.h"
+
+namespace Kontroller
+{
+   SharedStateReader::SharedStateReader(const char* name /*= kSharedStateName*/)
+      : name(name)
+   {
+      connect();
+   }
+
+   SharedStateReader::~SharedStateReader() = default;
+
+   bool SharedStateReader::read(State& state, uint64_t* version /*= nullptr*/, uint64_t* lastEventSequence /*= nullptr*/)
+   {
+      if (!connect())
+      {
+         return false;
+      }
+
+      // Bounded, since a server that died part way through a write leaves the lock looking busy forever
+      SeqLock<SharedStateBlock::kNumWords>::Words words;
+      uint64_t readVersion = 0;
+      if (!block->lock.tryRead(words, readVersion, StateLock::kMaxReadAttempts))
+      {
+         return false;
+      }
+
+      StateLock::decode(words.data(), state);
+
+      if (version)
+      {
+         *version = readVersion;
+      }
+      if (lastEventSequence)
+      {
+         *lastEventSequence = words[SharedStateBlock::kSequenceWord] | (static_cast<uint64_t>(words[SharedStateBlock::kSequenceWord + 1]) << 32);
+      }
+
+      return true;
+   }
+
+   uint64_t SharedStateReader::getVersion()
+   {
+      return connect() ? block->lock.getVersion() : 0;
+   }
+
+   bool SharedStateReader::connect()
+   {
+      if (block && block->magic.load(std::memory_order_acquire) == SharedStateBlock::kMagic)
+      {
+         std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+         if (now < nextReplacementCheck)
+         {
+            return true;
+         }
+
+         nextReplacementCheck = now + kSharedBlockCheckInterval;
+         if (!memory->wasReplaced())
+         {
+            return true;
+         }
+      }
+
+      // Either not connected yet, or the server shut down or crashed (in which case a new one may have replaced the block)
+      block = nullptr;
+      memory = std::make_unique<SharedMemory>(name, sizeof(SharedStateBlock), SharedMemory::Mode::OpenReadOnly);
+      if (!memory->isValid())
+      {
+         memory.reset();
+         return false;
+      }
+
+      const SharedStateBlock* newBlock = static_cast<const SharedStateBlock*>(memory->getData());
+      if (newBlock->magic.load(std::memory_order_acquire) != SharedStateBlock::kMagic || newBlock->version != SharedStateBlock::kVersion)
+      {
+         memory.reset();
+         return false;
+      }
+
+      block = newBlock;
+      nextReplacementCheck = std::chrono::steady_clock::now() + kSharedBlockCheckInterval;
+      return true;
+   }
+}
@@ -1,6 +1,8 @@
 #include "Sock.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 
 namespace Kontroller
 {
@@ -41,6 +43,51 @@ namespace Kontroller
 
             return Result::Success;
          }
+
+         bool enableKeepAlive(Socket socket, int timeoutMS)
+         {
+            int enable = 1;
+            if (Sock::setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable)) == kSocketError)
+            {
+               return false;
+            }
+
+            // Keepalive options only have a granularity of seconds, so this is as close as it gets: start probing after a quiet second or so, then give up after a couple of unanswered probes
+            int idleSeconds = std::max(timeoutMS / 2000, 1);
+            int intervalSeconds = 1;
+            int probeCount = 2;
+#if defined(TCP_KEEPIDLE)
+            Sock::setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &idleSeconds, sizeof(idleSeconds));
+#elif defined(TCP_KEEPALIVE)
+            Sock::setsockopt(socket, IPPROTO_TCP, TCP_KEEPALIVE, &idleSeconds, sizeof(idleSeconds));
+#endif
+#if defined(TCP_KEEPINTVL)
+            Sock::setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &intervalSeconds, sizeof(intervalSeconds));
+#endif
+#if defined(TCP_KEEPCNT)
+            Sock::setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &probeCount, sizeof(probeCount));
+#endif
+
+            return true;
+         }
+
+#if SOCK_UNIX_DOMAIN
+         bool makeUnixAddress(const char* path, sockaddr_un& address, socklen_t& addressLength)
+         {
+            std::size_t pathLength = strlen(path);
+            if (pathLength == 0 || pathLength >= sizeof(address.sun_path))
+            {
+               return false;
+            }
+
+            address = {};
+            address.sun_family = AF_UNIX;
+            memcpy(address.sun_path, path, pathLength);
+
+            addressLength = sizeof(address);
+            return true;
+         }
+#endif
       }
    }
 }
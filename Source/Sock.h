@@ -25,9 +25,13 @@
 #  include <sys/ioctl.h>
 #  include <sys/socket.h>
 #  include <sys/types.h>
+#  include <sys/un.h>
 #  include <unistd.h>
 #endif
 
+// Unix domain sockets (for clients on the same machine) are only used on POSIX platforms
+#define SOCK_UNIX_DOMAIN SOCK_POSIX
+
 namespace Kontroller
 {
    namespace Sock
@@ -284,6 +288,15 @@ namespace Kontroller
       namespace Helpers
       {
          Result poll(Socket socket, short events, int timeoutMS, const char* caller = nullptr, bool printErrors = false);
+
+         // Lets the OS detect a dead peer on an otherwise quiet TCP connection, aiming for (but, depending on the platform, not necessarily achieving) the given timeout
+         // Only probes while nothing is in flight, so a peer that is slow to acknowledge data (e.g. a slow reader, or a lossy link) is left alone
+         bool enableKeepAlive(Socket socket, int timeoutMS);
+
+#if SOCK_UNIX_DOMAIN
+         // Returns false if the path doesn't fit in a sockaddr_un
+         bool makeUnixAddress(const char* path, sockaddr_un& address, socklen_t& addressLength);
+#endif
       }
    }
 }
@@ -0,0 +1,239 @@
+#pragma once
+
+#include "Kontroller/State.h"
+
+#include "SeqLock.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+namespace Kontroller
+{
+   // State that one thread writes while any number of others read it, without ever waiting on each other (threads that want to wait for a change can, see waitForChange())
+   // Each control is stored as one word (buttons, then dials, then sliders, each in enum order) holding the same value as the control's EventPacket
+   class StateLock
+   {
+   public:
+      static constexpr std::size_t kNumWords = kNumControls;
+
+      // Enough to get past any write that is in progress (which only ever changes a handful of words), without waiting indefinitely on a writer that was preempted part way through
+      static constexpr int kMaxReadAttempts = 16;
+
+      using Words = SeqLock<kNumWords>::Words;
+
+      // Starts out with the default state, at version 0
+      StateLock()
+      {
+         current = encode(State());
+         for (std::size_t i = 0; i < kNumWords; ++i)
+         {
+            lock.store(i, current[i]);
+         }
+      }
+
+      // Writes must only be made by one thread at a time, and writes that don't change anything are skipped (so the version only increases when something changes)
+      void set(const State& state)
+      {
+         Words words = encode(state);
+         if (words == current)
+         {
+            return;
+         }
+
+         uint64_t newVersion = lock.getVersion() + 1;
+         lock.beginWrite();
+         for (std::size_t i = 0; i < kNumWords; ++i)
+         {
+            if (words[i] != current[i])
+            {
+               lock.store(i, words[i]);
+               changeVersions[i].store(newVersion, std::memory_order_relaxed);
+            }
+         }
+         lock.endWrite();
+
+         current = words;
+         notifyWaiters();
+      }
+
+      void set(Button button, bool pressed)
+      {
+         std::size_t index = static_cast<std::size_t>(button);
+         if (index >= 1 && index <= kNumButtons)
+         {
+            write(index - 1, encode(pressed));
+         }
+      }
+
+      void set(Dial dial, float value)
+      {
+         std::size_t index = static_cast<std::size_t>(dial);
+         if (index >= 1 && index <= kNumDials)
+         {
+            write(kNumButtons + index - 1, encode(value));
+         }
+      }
+
+      void set(Slider slider, float value)
+      {
+         std::size_t index = static_cast<std::size_t>(slider);
+         if (index >= 1 && index <= kNumSliders)
+         {
+            write(kNumButtons + kNumDials + index - 1, encode(value));
+         }
+      }
+
+      // Wait-free, returns the version of the state that was read (see getVersion())
+      // Only if a writer stalls in the middle of a write can the controls come from either side of it (every control's value is still one that was written)
+      uint64_t read(State& state) const
+      {
+         Words words;
+         uint64_t version = 0;
+         lock.tryRead(words, version, kMaxReadAttempts);
+
+         decode(words.data(), state);
+         return version;
+      }
+
+      // Increases with every change, so that readers can cheaply tell whether there is anything new to read
+      uint64_t getVersion() const
+      {
+         return lock.getVersion();
+      }
+
+      // Controls that changed after the given version, one bit per control in the same order as the words (and as a Subscription's mask)
+      // May include changes newer than a state that was read just before, but never misses one that the state includes
+      uint64_t getChangedControls(uint64_t sinceVersion) const
+      {
+         static_assert(kNumWords <= 64, "Change mask is too small");
+
+         uint64_t mask = 0;
+         for (std::size_t i = 0; i < kNumWords; ++i)
+         {
+            if (changeVersions[i].load(std::memory_order_relaxed) > sinceVersion)
+            {
+               mask |= 1ull << i;
+            }
+         }
+
+         return mask;
+      }
+
+      // Blocks until the version is newer than the given one, returns false if the timeout expires first
+      bool waitForChange(uint64_t lastVersion, std::chrono::milliseconds timeout) const
+      {
+         std::unique_lock<std::mutex> waitLock(waitMutex);
+         numWaiters.fetch_add(1);
+         std::atomic_thread_fence(std::memory_order_seq_cst);
+
+         bool changed = waitCondition.wait_for(waitLock, timeout, [this, lastVersion]
+         {
+            return getVersion() > lastVersion;
+         });
+         numWaiters.fetch_sub(1);
+
+         return changed;
+      }
+
+      static void decode(const uint32_t* words, State& state)
+      {
+         for (std::size_t i = 0; i < kNumButtons; ++i)
+         {
+            *state.getButtonPointer(static_cast<Button>(i + 1)) = words[i] != 0;
+         }
+
+         for (std::size_t i = 0; i < kNumDials; ++i)
+         {
+            std::memcpy(state.getDialPointer(static_cast<Dial>(i + 1)), &words[kNumButtons + i], sizeof(float));
+         }
+
+         for (std::size_t i = 0; i < kNumSliders; ++i)
+         {
+            std::memcpy(state.getSliderPointer(static_cast<Slider>(i + 1)), &words[kNumButtons + kNumDials + i], sizeof(float));
+         }
+      }
+
+   private:
+      static uint32_t encode(bool value)
+      {
+         return value ? 1 : 0;
+      }
+
+      static uint32_t encode(float value)
+      {
+         static_assert(sizeof(float) == sizeof(uint32_t), "Controls must fit in a word");
+
+         uint32_t word = 0;
+         std::memcpy(&word, &value, sizeof(word));
+         return word;
+      }
+
+      static Words encode(State state)
+      {
+         Words words;
+         for (std::size_t i = 0; i < kNumButtons; ++i)
+         {
+            words[i] = encode(*state.getButtonPointer(static_cast<Button>(i + 1)));
+         }
+         for (std::size_t i = 0; i < kNumDials; ++i)
+         {
+            words[kNumButtons + i] = encode(*state.getDialPointer(static_cast<Dial>(i + 1)));
+         }
+         for (std::size_t i = 0; i < kNumSliders; ++i)
+         {
+            words[kNumButtons + kNumDials + i] = encode(*state.getSliderPointer(static_cast<Slider>(i + 1)));
+         }
+
+         return words;
+      }
+
+      void write(std::size_t index, uint32_t word)
+      {
+         if (word == current[index])
+         {
+            return;
+         }
+
+         // The change version is written as part of the write, so that any reader that sees the new value also sees that it changed
+         uint64_t newVersion = lock.getVersion() + 1;
+         lock.beginWrite();
+         lock.store(index, word);
+         changeVersions[index].store(newVersion, std::memory_order_relaxed);
+         lock.endWrite();
+
+         current[index] = word;
+         notifyWaiters();
+      }
+
+      void notifyWaiters()
+      {
+         // Pairs with the increment in waitForChange(): either the waiter sees the new version, or this sees the waiter (and has to wait for it to be waiting before notifying it)
+         std::atomic_thread_fence(std::memory_order_seq_cst);
+         if (numWaiters.load(std::memory_order_relaxed) == 0)
+         {
+            return;
+         }
+
+         {
+            std::lock_guard<std::mutex> waitLock(waitMutex);
+         }
+         waitCondition.notify_all();
+      }
+
+      SeqLock<kNumWords> lock;
+      std::array<std::atomic<uint64_t>, kNumWords> changeVersions = {};
+
+      // Only used by the writer
+      Words current = {};
+
+      mutable std::mutex waitMutex;
+      mutable std::condition_variable waitCondition;
+      mutable std::atomic<int> numWaiters = { 0 };
+   };
+}